@@ -1,23 +1,176 @@
 //STEP 1: Please run: " gcc new.c -o output -lpthread -lncurses " on terminal.
+//        Add " -DWAREHOUSE_INSTRUMENT " to time every credit wait and lock wait/hold (printed with the final statistics).
+//        Add " -DWAREHOUSE_PACKED " to drop the cache-line padding, e.g. to compare cache misses in --bench rows.
 //STEP 2: Create a new file in your directory where source code is placed using: " touch warehouse.log " use the provided file name only as it is used in the code. 
-//STEP 3: For output, please run: " ./output " on terminal.
+//STEP 3: For output, please run: " ./output " on terminal. Add " --engine=lockfree " to use the lock-free queue instead of the mutex one,
+//        and " --capacity=N " (suffixes k/m allowed) to change the buffer size.
+//        For a headless queue benchmark run " ./output --bench " (see --help for the sweep options).
+//        " --log-format=binary " writes warehouse.log.NNNNNN.bin segments instead of text; turn them back
+//        into text or CSV with " ./output --read-events [--read-format=classic|precise|csv] FILE... ".
+//        " --levels=N " adds priority levels beyond normal/urgent; " --policy=strict|wrr|deadline " picks how
+//        retailers choose between them.
+//        " --engine=steal " gives every retailer its own deque; idle retailers steal from the others.
+//        " --supplier-cpus=0-3 --retailer-cpus=4-7 " pins the threads; " --mem-node " picks where queue memory lives.
+//        " ./output --stress " hammers the queues with many threads and checks produced == consumed + residual.
+//        " --suppliers=N --retailers=N --count=N " skip the prompts, " --no-ui " runs without ncurses and
+//        " --config=FILE " reads the same options as "option = value" lines (command-line flags win).
+//        " --metrics-port=9464 " serves Prometheus metrics on http://127.0.0.1:9464/metrics while the simulation runs.
+//        " --seed=N --arrival=poisson --item-dist=zipf " etc. shape the supplier traffic reproducibly (see --help).
+//        " --shm=/wh --role=suppliers " and " --shm=/wh --role=retailers " in separate terminals share one warehouse.
+//        " --payload=64-4096 " sends order records of those sizes through the queues as arena-backed descriptors.
+//        " --trace=trace.json --trace-sample=100 " records sampled supplier/retailer spans for ui.perfetto.dev.
+//        " --autoscale " parks and wakes suppliers/retailers (up to the counts given) to follow the load.
+//        " --overflow=drop-oldest-normal " lets urgent items replace normal ones when full (see --help for the others).
+//        " --overflow=spill " keeps the overflow in mmap'd, recycled segment files (--spill-segment-size).
+//        " --snapshot=wh.snap " saves the stock every 5 s and at exit; " --restore=wh.snap " starts from it.
+//        " --tasks=4 " runs the suppliers and retailers as tasks on 4 threads, e.g. for 10000 stores.
+//        " --shards=4 " splits the warehouse in 4, items routed by id; idle retailers steal from the fullest.
+//        " --replay warehouse.log " feeds a recorded run back through the warehouse and writes replay.csv.
 //STEP 4: Press " Ctrl + C " for forced termination else wait for the simulation to be ended automatically.
+//        The first Ctrl+C stops the suppliers and lets the retailers drain the stock (" --drain-timeout=S ",
+//        " --on-signal=abort " skips it); a second one aborts the drain, a third exits at once.
+
+#define _GNU_SOURCE   // CPU affinity, sched_getcpu
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <unistd.h>
 #include <time.h>
 #include <string.h>
 #include <signal.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <ncurses.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <getopt.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+#define DEFAULT_BUFFER_SIZE 10
+#define CACHE_LINE 64
+
+// Fields written by one side and read by the other each get their own cache
+// line. Building with -DWAREHOUSE_PACKED drops the padding, so the cache-miss
+// columns of --bench can show what it buys.
+#ifdef WAREHOUSE_PACKED
+#define CACHE_ALIGNED
+#define LAYOUT_NAME "packed"
+#else
+#define CACHE_ALIGNED _Alignas(CACHE_LINE)
+#define LAYOUT_NAME "padded"
+#endif
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+// Latency histogram: values below 2^HIST_SUB_BITS ns get their own bucket,
+// larger ones are split into 2^HIST_SUB_BITS buckets per power of two (~3% error)
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+#define BENCH_MAX_POINTS 16
+
+// Largest burst a supplier may push or a retailer may drain in one call
+#define MAX_BATCH 4096
+
+// Asynchronous logger: each worker thread owns a ring of LOG_RING_SIZE events
+// that the logger thread drains, formats and writes in batches
+#define LOG_RING_SIZE 4096
+#define LOG_BATCH_EVENTS 16384
+#define LOG_WRITE_BUFFER (1 << 20)
+#define LOG_IDLE_SLEEP_MS 5
+
+#define EVENT_PRODUCED 0
+#define EVENT_CONSUMED 1
 
-#define BUFFER_SIZE 10
+#define LOG_FORMAT_CLASSIC 0   // same lines warehouse.log always had
+#define LOG_FORMAT_PRECISE 1   // classic plus microseconds
+#define LOG_FORMAT_BINARY 2    // fixed-size records in mmap'd segment files
+#define LOG_FORMAT_CSV 3       // only used by --read-events
+
+#define SEGMENT_MAGIC "WHEVTLOG"
+#define SEGMENT_VERSION 1
+#define DEFAULT_SEGMENT_BYTES (64UL << 20)
+
+#define DEFAULT_UI_HZ 10
+
+// Wait-time histograms for the metrics endpoint: bucket b counts waits of at
+// most 2^(b + WAIT_HIST_SHIFT) ns, the last one everything longer
+#define WAIT_HIST_BUCKETS 28
+#define WAIT_HIST_SHIFT 8
+#define METRICS_BUFFER_SIZE (64 * 1024)
+
+// Upper bound for the adaptive spin before a waiter parks on the futex
+#define FSEM_SPIN_MAX 4096
+
+// Priority levels: 0 is normal stock, higher numbers are more urgent.
+// MAX_PRIORITY is the default number of levels, MAX_LEVELS the upper bound.
 #define MAX_PRIORITY 2
+#define MAX_LEVELS 32
+
+// --shards=N upper bound; the warehouse itself is shard 0
+#define MAX_SHARDS 16
+
+// Policies for choosing which level a retailer serves next
+#define POLICY_STRICT 0     // always the most urgent non-empty level
+#define POLICY_WRR 1        // weighted round-robin across non-empty levels
+#define POLICY_DEADLINE 2   // earliest deadline first; less urgent levels get longer budgets
+#define DEFAULT_DEADLINE_MS 2000
+
+// Queue engines selectable at startup
+#define ENGINE_MUTEX 0      // mutex + semaphores around the level queues
+#define ENGINE_LOCKFREE 1   // lock-free MPMC rings, semaphores only count slots
+#define ENGINE_STEAL 2      // per-retailer deques, idle retailers steal from others
 
-char last_action[100] = "Waiting...";
+// How suppliers pick the retailer deque for the steal engine
+#define ROUTE_ROUND_ROBIN 0
+#define ROUTE_LEAST_LOADED 1
+
+int queue_engine = ENGINE_MUTEX;
+
+// Thread placement. CPU lists pin thread i of a role to list[i % count];
+// empty lists leave the thread to the scheduler.
+#define MAX_CPUS 1024
+#define MAX_NODES 64
+#define MEM_NODE_FIRST_TOUCH -1   // let the kernel place pages where they are first written
+#define MEM_NODE_SUPPLIERS -2     // node of the first supplier CPU
+#define MEM_NODE_RETAILERS -3     // node of the first retailer CPU
+#define MPOL_PREFERRED 1          // from <numaif.h>, which needs libnuma headers
+#define MPOL_MF_MOVE (1 << 1)
+
+int supplier_cpus[MAX_CPUS], supplier_cpu_count = 0;
+int retailer_cpus[MAX_CPUS], retailer_cpu_count = 0;
+int mem_node = MEM_NODE_FIRST_TOUCH;
+int numa_nodes = 1;
+int cpu_to_node[MAX_CPUS];
+int slot_node = -1;                // node alloc_slots binds new storage to, -1 for none
+__thread int my_node = -1;
+
+// Last action packed into one word so workers can publish it without a lock:
+// bits 0-31 item, 32-51 thread id, 52-56 priority level, 57-58 action kind
+#define ACTION_NONE 0
+#define ACTION_PRODUCED 1
+#define ACTION_CONSUMED 2
+#define PACK_ACTION(kind, id, item, priority) \
+    (((uint64_t)(kind) << 57) | ((uint64_t)((priority) & 0x1F) << 52) | \
+     ((uint64_t)((id) & 0xFFFFF) << 32) | (uint32_t)(item))
+
+CACHE_ALIGNED _Atomic uint64_t last_action = 0;   // written by every worker, so kept off other lines
 volatile sig_atomic_t simulation_running = 1;
 
 // Thresholds for generating stock alerts
@@ -27,320 +180,6337 @@ volatile sig_atomic_t simulation_running = 1;
 int NUM_PRODUCERS;
 int NUM_CONSUMERS;
 
-// Shared buffer for normal items
-int buffer[BUFFER_SIZE];
-int in = 0, out = 0;
+// Items each supplier pushes per burst and each retailer drains at most per visit
+int supplier_batch = 1;
+int retailer_batch = 1;
+
+// Number of slots per buffer, chosen at startup and rounded up to a power of
+// two so that positions wrap with buffer_mask instead of a modulo
+size_t buffer_capacity = DEFAULT_BUFFER_SIZE;
+size_t buffer_mask;
+
+int priority_levels = MAX_PRIORITY;
+int schedule_policy = POLICY_STRICT;
+long wrr_weights[MAX_LEVELS];          // by rank, most urgent first; 0 = default (levels - rank)
+long deadline_ms = DEFAULT_DEADLINE_MS;
+
+// Levels are stored by rank: rank 0 is the most urgent level
+// (priority priority_levels - 1) and the last rank is normal stock.
+#define LEVEL_RANK(priority) (priority_levels - 1 - (priority))
+
+// One item waiting in a level queue, with its enqueue time for the deadline policy
+struct level_slot {
+    int item;
+    uint64_t stamp;
+};
+
+// Level queue used by the mutex engine. in/out run freely and are masked on
+// access, so in - out is the number of stocked items. They are only written
+// under the mutex, but atomic so that observers can read them without it.
+// Each side keeps a copy of the other side's index on its own line and only
+// reloads the real one when the copy says full (or empty); indexes only grow,
+// so a stale copy errs on the safe side.
+struct level_queue {
+    CACHE_ALIGNED atomic_size_t in;    // producer side
+    size_t out_cached;
+    CACHE_ALIGNED atomic_size_t out;   // consumer side
+    size_t in_cached;
+};
+
+// buffer_capacity slots per level queue, by shard and rank. level_slots is
+// the calling thread's view: the shard it is working on (see shard_enter).
+struct level_slot* shard_slots[MAX_SHARDS][MAX_LEVELS];
+__thread struct level_slot** level_slots = shard_slots[0];
+
+// Bounded lock-free MPMC ring (Vyukov style). Each cell carries a sequence
+// number telling producers and consumers whose turn it is on that cell, so
+// they only ever contend on their own position counter.
+struct ring_cell {
+    atomic_size_t seq;
+    int item;
+    _Atomic uint64_t stamp;    // read by other consumers peeking for the deadline policy
+};
+
+struct mpmc_ring {
+    struct ring_cell* cells;
+    size_t mask;
+    size_t bytes;
+    CACHE_ALIGNED atomic_size_t enqueue_pos;
+    CACHE_ALIGNED atomic_size_t dequeue_pos;
+};
+
+// Lock-free counterparts of the level queues
+struct mpmc_ring shard_rings[MAX_SHARDS][MAX_LEVELS];
+__thread struct mpmc_ring* level_rings = shard_rings[0];
+
+// Work-stealing engine: every retailer owns one deque per level. Suppliers
+// append at the bottom under a small per-deque spinlock; the owner and thieves
+// both take from the top with a CAS, so the push end is the only locked one and
+// retailers only meet on the same index while stealing.
+struct deque_slot {
+    atomic_int item;              // read by takers that may lose the CAS
+    _Atomic uint64_t stamp;
+};
+
+struct steal_deque {
+    struct deque_slot* slots;     // buffer_capacity entries, masked like the rings
+    CACHE_ALIGNED atomic_size_t top;
+    atomic_size_t bottom_cached;  // takers' last look at bottom, on their own line
+    CACHE_ALIGNED atomic_size_t bottom;
+    atomic_flag push_lock;
+};
+
+struct retailer_deques {
+    CACHE_ALIGNED atomic_uint nonempty;          // same role as nonempty_levels
+    uint64_t stolen;                             // items this retailer took from others
+    uint64_t stolen_remote;                      // ... of which from retailers on other nodes
+    atomic_int node;                             // NUMA node of the owner, -1 while unknown
+    atomic_int parked;                           // owner parked by the autoscaler: route elsewhere
+    struct steal_deque levels[MAX_LEVELS];
+};
+
+struct retailer_deques* steal_deques;   // NUM_CONSUMERS entries
+int steal_route = ROUTE_ROUND_ROBIN;
+atomic_int steal_attached;              // retailers that claimed a deque so far
+atomic_uint steal_route_seed;
+
+__thread int my_retailer = -1;          // own deque, or -1 for threads that only steal
+__thread struct retailer_deques* steal_source;  // deque set pick_level is looking at
+__thread unsigned route_next;
+__thread int route_ready;
+
+// Per-retailer weighted round-robin position
+__thread int wrr_rank = -1;
+__thread long wrr_left = 0;
+
+// Lock-free histogram of wait times; only slow paths record into it, so a
+// relaxed fetch_add per wait is cheap enough
+struct wait_hist {
+    atomic_uint_fast64_t buckets[WAIT_HIST_BUCKETS];
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum_ns;
+};
+
+// Time spent blocked on the warehouse mutex (contended acquisitions only)
+struct wait_hist lock_wait;
+
+// Counting semaphore on a futex. Waiters spin for an adaptive while and then
+// park in the kernel, so idle threads cost no CPU; posts only enter the
+// kernel when someone is parked.
+struct fsem {
+    CACHE_ALIGNED atomic_int count;
+    atomic_int waiters;
+    atomic_int spin_limit;
+    // Slow-path statistics, kept off the hot line
+    CACHE_ALIGNED atomic_uint_fast64_t parks;
+    atomic_uint_fast64_t unparks;      // threads actually woken by posts
+    atomic_uint_fast64_t spurious;     // woken but found no credit
+    atomic_uint_fast64_t spin_hits;    // credit arrived while spinning
+    struct wait_hist wait;             // time from a failed fast path to getting a credit
+};
+
+int fsem_spin_max = FSEM_SPIN_MAX;     // 0 on single-CPU machines, where spinning cannot help
+
+// Everything the suppliers and retailers coordinate through. It is a plain
+// global unless --shm places it in a shared-memory segment (see shm_attach).
+struct warehouse_state {
+    // Shared credit pool: "empty" holds one credit per free slot of the whole
+    // warehouse (buffer_capacity in total, across all levels) and "full" one per
+    // stocked item. Every level queue is sized to the full capacity, so a producer
+    // holding a credit always finds room in whichever level it picks.
+    struct fsem empty, full;
+
+    // Mutex for critical section to prevent race conditions
+    CACHE_ALIGNED pthread_mutex_t mutex;
+
+    // Bit r is set while the level of rank r may hold items, so the next level to
+    // serve under the strict policy is simply ctz(nonempty_levels)
+    CACHE_ALIGNED atomic_uint nonempty_levels;
+
+    struct level_queue levels[MAX_LEVELS];
+
+    // Claim tickets bounding the run: a supplier reserves supply_count
+    // tickets for each batch it is about to make and a retailer reserves
+    // simulation_count tickets for the items it is about to take, so exactly
+    // --count items are made and consumed without taking the mutex
+    CACHE_ALIGNED atomic_int simulation_count;
+    CACHE_ALIGNED atomic_int supply_count;
+};
+
+// warehouse is the shard this thread is working on; the claim tickets are
+// only used in shard 0's, which is where every thread starts and returns.
+struct warehouse_state private_warehouse;
+struct warehouse_state shard_warehouses[MAX_SHARDS - 1];        // shards 1.. with --shards
+struct warehouse_state* shard_state[MAX_SHARDS] = {&private_warehouse};
+__thread struct warehouse_state* warehouse = &private_warehouse;
+
+// Per-thread 64-bit counters, one cache line each. Only the owning thread
+// writes its shard; readers add the shards up when they need totals.
+struct thread_stats {
+    CACHE_ALIGNED atomic_uint_fast64_t produced;
+    atomic_uint_fast64_t consumed;
+};
+
+struct thread_stats* supplier_stats = NULL;
+struct thread_stats* retailer_stats = NULL;
+
+struct lat_hist {
+    uint64_t count;
+    uint64_t max;
+    uint64_t sum;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+// Benchmark mode: sleeps, ncurses, prompts and the log file are all skipped
+int bench_mode = 0;
+int bench_json = 0;
+long bench_items = 1000000;
+int bench_producers[BENCH_MAX_POINTS] = {1, 2, 4};
+int bench_producer_points = 3;
+int bench_consumers[BENCH_MAX_POINTS] = {1, 2, 4};
+int bench_consumer_points = 3;
+long bench_capacities[BENCH_MAX_POINTS] = {16, 1024, 65536};
+int bench_capacity_points = 3;
+int bench_engines[BENCH_MAX_POINTS] = {ENGINE_MUTEX, ENGINE_LOCKFREE};
+int bench_engine_points = 2;
+long bench_batches[BENCH_MAX_POINTS] = {1};
+int bench_batch_points = 1;
+int bench_allocs[BENCH_MAX_POINTS] = {0};   // PAYLOAD_ARENA / PAYLOAD_MALLOC, swept with --payload
+int bench_alloc_points = 1;
+int bench_batch;                       // batch size of the point being measured
+
+// One event, both in the per-thread rings and on disk in binary segments
+struct log_record {
+    uint64_t mono_ns;      // CLOCK_MONOTONIC
+    int32_t thread_id;
+    int32_t item;
+    uint32_t depth;        // items in the warehouse right after the event
+    uint8_t event;
+    uint8_t priority;
+    uint16_t reserved;
+};
+_Static_assert(sizeof(struct log_record) == 24, "log_record is an on-disk format");
+
+// First bytes of every binary segment. Records start right after it and
+// record_count is bumped as they are appended, so a reader never sees
+// half-written data past it.
+struct segment_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    int64_t clock_offset_ns;   // CLOCK_REALTIME - CLOCK_MONOTONIC when the segment was opened
+    _Atomic uint64_t record_count;
+    uint8_t reserved[32];
+};
+_Static_assert(sizeof(struct segment_header) == 64, "segment_header is an on-disk format");
+
+// Append-only, mmap'd segment the logger thread writes binary records into
+struct event_segment {
+    int fd;
+    unsigned seq;
+    size_t bytes;
+    struct segment_header* header;
+    struct log_record* records;
+    size_t capacity;           // records that fit in this segment
+    size_t synced;             // records already msync'ed
+};
+
+// Single-producer/single-consumer event ring owned by one worker thread.
+// Buffers are chained into a lock-free list when a thread logs its first event.
+struct log_buffer {
+    struct log_buffer* next;
+    _Alignas(64) atomic_size_t head;   // advanced by the logger thread
+    _Alignas(64) atomic_size_t tail;   // advanced by the owning thread
+    struct log_record records[LOG_RING_SIZE];
+};
+
+const char* log_path = "warehouse.log";
+int log_fd = -1;
+int log_format = LOG_FORMAT_CLASSIC;
+int64_t log_clock_offset_ns;           // converts record timestamps to wall clock time
+size_t segment_bytes = DEFAULT_SEGMENT_BYTES;
+struct event_segment segment = {.fd = -1};
+int read_events_mode = 0;
+int read_format = LOG_FORMAT_CLASSIC;
+
+// Replay (--replay): a recorded event stream, warehouse.log lines or binary
+// segments, is fed back through a fresh warehouse by one thread in log
+// order, with the recorded gaps (scaled by replay_speed, 0 = none) or as
+// fast as it goes. Produces that find the warehouse full wait in order for
+// the next consume, and consumes logged ahead of their item take it as soon
+// as it arrives. The queue depth after every event is compared with the one
+// recorded (binary segments) or implied by the log (text).
+#define REPLAY_BATCH 4096
+#define DEFAULT_REPLAY_BUCKET_MS 100
+
+struct replay_event {
+    uint64_t wall_ns;
+    int32_t item;
+    uint32_t depth;        // recorded depth; binary segments only
+    uint8_t event;
+    uint8_t priority;
+};
+
+// One input file, mapped whole and read front to back
+struct replay_source {
+    const char* path;
+    char* mem;
+    size_t bytes;
+    int binary;
+    const struct log_record* records;  // binary: the records and their count
+    uint64_t count;
+    int64_t offset_ns;                 // binary: monotonic to wall clock
+    size_t pos;                        // next record, or next byte of text
+    char stamp[19];                    // text: last "YYYY-mm-dd HH:MM:SS" seen ...
+    time_t stamp_sec;                  // ... and its time
+    uint64_t skipped;                  // text lines that are not events
+};
+
+int replay_mode = 0;
+double replay_speed = 1.0;
+long replay_bucket_ms = DEFAULT_REPLAY_BUCKET_MS;
+const char* replay_csv_path = "replay.csv";
+long log_fsync_ms = 1000;              // fsync at least this often while events arrive
+long log_fsync_bytes = 4 << 20;        // ... or once this much was written since the last one
+_Atomic(struct log_buffer*) log_buffers = NULL;
+atomic_int logger_stop;
+pthread_t logger_thread;
+__thread struct log_buffer* my_log_buffer = NULL;
+
+// What the UI thread draws; a field is only redrawn when it changed
+struct ui_snapshot {
+    int normal;
+    int urgent;
+    int levels[MAX_LEVELS];
+    int shards[MAX_SHARDS];            // stock per shard, all levels
+    uint64_t stolen;                   // items retailers took from other shards than their own
+    uint64_t produced;
+    uint64_t consumed;
+    uint64_t supplier_min, supplier_max;
+    uint64_t retailer_min, retailer_max;
+    uint64_t action;
+    int shutdown;
+    int active_suppliers, active_retailers;
+};
+
+int ui_hz = DEFAULT_UI_HZ;
+int ui_enabled = 1;                    // --no-ui runs headless: no ncurses, no UI thread
+
+// Prometheus text endpoint, off unless --metrics-port is given
+int metrics_port = 0;
+const char* metrics_addr = "127.0.0.1";
+int metrics_fd = -1;
+atomic_int metrics_stop;
+pthread_t metrics_thread;
+atomic_int ui_stop;
+pthread_t ui_thread;
 
-// Separate buffer for priority (urgent) items
-int urgent_buffer[BUFFER_SIZE];
-int urgent_in = 0, urgent_out = 0;
-int urgent_count = 0; // Tracks number of urgent items
+// Shared-memory mode (--shm=NAME): the warehouse_state and the level slots sit
+// in a POSIX shared-memory segment, so separate supplier and retailer
+// processes work on the same stock. Only the mutex engine is supported, as
+// crash recovery builds on its robust process-shared mutex: credits are taken
+// under it in the same step as the slot update, so the level queues alone
+// tell what the credits must be after an owner died mid-update.
+// The magic also names the struct layout, as a packed and a padded build
+// place every field at different offsets.
+#ifdef WAREHOUSE_PACKED
+#define SHM_MAGIC 0x57484d50u          // "WHMP"
+#else
+#define SHM_MAGIC 0x57484d31u          // "WHM1"
+#endif
+#define SHM_MAX_PROCESSES 64
+#define ROLE_ALL 0
+#define ROLE_SUPPLIERS 1
+#define ROLE_RETAILERS 2
 
-// Semaphores for tracking empty and full slots
-sem_t empty, full;
+struct shm_process {
+    atomic_int pid;                    // 0 for a free entry
+    int role;
+    int claimed;                       // count tickets taken but not consumed yet; under the mutex
+    int supplying;                     // supply tickets taken but not stocked yet; under the mutex
+};
 
-// Mutex for critical section to prevent race conditions
-pthread_mutex_t mutex;
+struct shm_header {
+    atomic_uint magic;                 // stored last by the creating process; first, so any build can read it
+    struct warehouse_state state;
+    size_t capacity;
+    int levels;
+    size_t bytes;                      // size of the whole segment
+    atomic_uint_fast64_t recoveries;   // mutex owners that died in the critical section
+    atomic_uint_fast64_t reaped;       // dead processes removed from the table
+    struct shm_process procs[SHM_MAX_PROCESSES];
+};                                     // followed by the level slots, CACHE_LINE aligned
 
-int simulation_count;
-int total_produced = 0;
-int total_consumed = 0;
+const char* shm_name = NULL;
+int shm_role = ROLE_ALL;
+int shm_fd = -1;
+struct shm_header* shm = NULL;
+struct shm_process* shm_me = NULL;     // this process's entry in shm->procs
+int futex_private = FUTEX_PRIVATE_FLAG;   // cleared when the futex words are shared between processes
+
+// Stress check: many threads hammer the warehouse and the books must balance
+int stress_mode = 0;
+long stress_seconds = 1;               // per sweep point
+int stress_threads[BENCH_MAX_POINTS] = {1, 16, 64};
+int stress_thread_points = 3;
+atomic_int stress_stop;
+
+// Per-thread tally of item counts and value sums, one cache line each
+struct stress_tally {
+    _Alignas(CACHE_LINE) uint64_t count;
+    uint64_t sum;
+};
+
+// Hot-path instrumentation, compiled in with -DWAREHOUSE_INSTRUMENT. Every
+// credit wait and every warehouse lock wait/hold is timed (TSC on x86, else
+// CLOCK_MONOTONIC) into per-thread log-linear histograms; without the define
+// the INSTR_* macros expand to nothing.
+#define INSTR_EMPTY_WAIT 0   // suppliers waiting for a free slot
+#define INSTR_FULL_WAIT 1    // retailers waiting for an item
+#define INSTR_LOCK_WAIT 2    // acquiring the warehouse mutex
+#define INSTR_LOCK_HOLD 3    // holding it
+#define INSTR_SITES 4
+
+#ifdef WAREHOUSE_INSTRUMENT
+struct instr_thread {
+    struct lat_hist sites[INSTR_SITES];
+    struct instr_thread* next;
+};
+
+_Atomic(struct instr_thread*) instr_threads;   // every thread that recorded something
+__thread struct instr_thread* my_instr;
+__thread uint64_t instr_hold_start;
+double instr_ticks_per_ns = 1.0;
+
+#define INSTR_START(var) uint64_t var = instr_now()
+#define INSTR_END(site, var) instr_record(site, instr_now() - (var))
+#define INSTR_HOLD_START() (instr_hold_start = instr_now())
+#define INSTR_HOLD_END() instr_record(INSTR_LOCK_HOLD, instr_now() - instr_hold_start)
+#else
+#define INSTR_START(var) do {} while (0)
+#define INSTR_END(site, var) do {} while (0)
+#define INSTR_HOLD_START() do {} while (0)
+#define INSTR_HOLD_END() do {} while (0)
+#endif
+
+// Workload shape. Each thread draws from its own PCG32 stream derived from
+// workload_seed, so a run is reproducible from --seed without any shared
+// (locked) generator state.
+#define ARRIVAL_FIXED 0      // one batch every arrival_ms
+#define ARRIVAL_UNIFORM 1    // gaps uniform in [0, 2 * arrival_ms]
+#define ARRIVAL_POISSON 2    // exponential gaps with mean arrival_ms
+#define ARRIVAL_BURSTY 3     // on/off: Poisson at 4x the rate while on, silent while off
+#define DIST_UNIFORM 0
+#define DIST_ZIPF 1
+#define DEFAULT_ARRIVAL_MS 3000
+#define DEFAULT_ITEM_RANGE 100
+#define MAX_ITEM_RANGE (1 << 24)
+
+struct pcg32 {
+    uint64_t state;
+    uint64_t inc;
+};
+
+uint64_t workload_seed;
+int seed_given = 0;
+int arrival_dist = ARRIVAL_FIXED;
+long arrival_ms = DEFAULT_ARRIVAL_MS;
+long burst_ms = 0;                     // mean on-phase length for bursty arrivals; 0 = 5 * arrival_ms
+int item_dist = DIST_UNIFORM;
+int item_range = DEFAULT_ITEM_RANGE;
+int priority_dist = DIST_UNIFORM;
+double zipf_s = 1.0;
+double* item_zipf_cdf;                 // item_range entries, shared read-only
+double priority_zipf_cdf[MAX_LEVELS];  // by priority, 0 (normal) most likely
+atomic_uint stress_streams;
+
+__thread struct pcg32 my_rng;
+__thread int burst_on;
+__thread double burst_left_ms;
+
+// Event tracing (--trace=FILE): supplier and retailer threads record sampled
+// spans into a ring of their own, with no shared state on the hot path, and
+// the rings are written out as Chrome trace_event JSON (chrome://tracing,
+// ui.perfetto.dev) when the run ends. --trace-sample=N keeps every Nth span
+// and the ring the latest TRACE_RING_SPANS of them; --trace-reservoir=K
+// instead keeps a uniform sample of K spans over the whole run (algorithm R).
+#define TRACE_PRODUCE 0      // supplier making a batch (the simulated work)
+#define TRACE_PUT 1          // put_products, including its waits
+#define TRACE_WAIT_SPACE 2   // waiting on "empty"
+#define TRACE_TAKE 3         // take_products, including its wait
+#define TRACE_WAIT_STOCK 4   // waiting on "full"
+#define TRACE_CONSUME 5      // retailer using a batch (the simulated work)
+#define TRACE_KINDS 6
+#define TRACE_RING_SPANS 16384   // per thread, power of two
+
+struct trace_span {
+    uint64_t start_ns;       // since trace_origin_ns
+    uint32_t dur_ns;         // saturates at about 4.3 s
+    uint16_t kind;
+    uint16_t items;
+};
+
+struct trace_thread {
+    struct trace_thread* next;
+    char name[32];
+    int tid;
+    uint64_t seen;           // spans begun, sampled or not
+    uint64_t seen_kind[TRACE_KINDS];   // the same by kind, so 1-in-N does not lock onto one nesting level
+    uint64_t kept;           // spans recorded (ring mode: also the next slot)
+    struct pcg32 rng;        // reservoir draws
+    struct trace_span spans[TRACE_RING_SPANS];
+};
+
+const char* trace_path = NULL;
+FILE* trace_file = NULL;
+int trace_sample = 1;
+int trace_reservoir = 0;               // K, or 0 for 1-in-N sampling into the ring
+uint64_t trace_origin_ns;
+_Atomic(struct trace_thread*) trace_threads;
+atomic_int trace_next_tid;
+__thread struct trace_thread* my_trace;
+
+// Payload records (--payload=MIN-MAX bytes). The queues keep carrying ints,
+// which then are descriptors: arena index and block number. Each producer
+// carves blocks out of its own arena, a reserved address range it bumps
+// through, and keeps per-size-class free lists. Consumers hand blocks back
+// by pushing them onto the owning arena's remote list for that class, which
+// the owner takes over in one exchange when its local list runs dry, so
+// neither side goes through malloc. --payload-alloc=malloc puts the record on
+// the heap instead (the block then only holds the pointer), for comparison.
+#define PAYLOAD_UNIT 64                        // smallest block, and the descriptor granularity
+#define PAYLOAD_CLASSES 8                      // blocks of 64 B .. 8 KB
+#define PAYLOAD_MAX_BYTES 4096
+#define ARENA_SHIFT 30                         // 1 GB of address space per arena, touched as used
+#define ARENA_BLOCK_BITS (ARENA_SHIFT - 6)
+#define MAX_ARENAS (1 << (31 - ARENA_BLOCK_BITS))
+#define PAYLOAD_ARENA 0
+#define PAYLOAD_MALLOC 1
+
+struct payload_block {
+    struct payload_block* next;                // free list link while not in use
+    uint32_t item;
+    uint32_t length;
+    int cls;
+    char* heap;                                // the record with --payload-alloc=malloc
+    char data[];
+};
+
+struct payload_arena {
+    char* base;
+    size_t used;                               // bump offset, owner only
+    struct payload_block* local[PAYLOAD_CLASSES];
+    uint64_t carved, reused;
+    _Alignas(CACHE_LINE) _Atomic(struct payload_block*) remote[PAYLOAD_CLASSES];
+};
+
+int payload_min = 0, payload_max = 0;          // 0 = plain int items
+int payload_alloc = PAYLOAD_ARENA;
+struct payload_arena* payload_arenas;
+int payload_arena_count;
+atomic_int payload_arena_next;
+__thread int my_arena = -1;
+
+// Shutdown. The signal handler only records the signal and pokes shutdown_fd;
+// the main thread coordinates the rest: the suppliers stop, the retailers
+// drain what is already stocked (for at most drain_timeout seconds), then
+// everyone is stopped and joined and the logger is flushed.
+#define SHUTDOWN_NONE 0      // running
+#define SHUTDOWN_DRAIN 1     // no new production, retailers empty the warehouse
+#define SHUTDOWN_STOP 2      // every thread leaves as soon as it can
+#define ON_SIGNAL_DRAIN 0
+#define ON_SIGNAL_ABORT 1
+#define DEFAULT_DRAIN_TIMEOUT 10
+
+atomic_int shutdown_phase;             // also a futex word: sleep_ms waits on it
+volatile sig_atomic_t signals_caught;
+volatile sig_atomic_t last_signal;
+int shutdown_fd = -1;                  // eventfd written by the handler and by the last retailer out
+int on_signal = ON_SIGNAL_DRAIN;
+int drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+atomic_int suppliers_left, retailers_left;
+char shutdown_report[160];             // how the run ended, for the final statistics
+
+// Autoscaling (--autoscale): the NUM_PRODUCERS / NUM_CONSUMERS threads are
+// the pool's upper bound, and a controller thread moves each role's active
+// count between 1 and that bound from the stock depth against the stock
+// thresholds and the consumer latency (stock / consumption rate, Little's
+// law). A signal has to persist for autoscale_hold ticks in a row before the
+// count moves one step, and the stock band between the thresholds changes
+// nothing. Thread i of a role works while i <= its active count; the others
+// park on scale_epoch between batches, holding no tickets, until they are
+// needed again, the tickets run out or a shutdown starts.
+#define DEFAULT_AUTOSCALE_MS 1000
+#define DEFAULT_AUTOSCALE_HOLD 3
+#define DEFAULT_AUTOSCALE_LATENCY_MS 10000
+
+struct scale_streak {
+    int sign;                          // direction the signal pointed at the last tick
+    int ticks;                         // ticks in a row it did so
+};
+
+int autoscale = 0;
+long autoscale_ms = DEFAULT_AUTOSCALE_MS;
+int autoscale_hold = DEFAULT_AUTOSCALE_HOLD;
+long autoscale_latency_ms = DEFAULT_AUTOSCALE_LATENCY_MS;
+atomic_int active_suppliers, active_retailers;
+atomic_int scale_epoch;                // futex word, bumped whenever a parked thread should look again
+atomic_uint_fast64_t scale_changes;
+pthread_t autoscale_thread;
+
+// What a supplier does when its batch finds the warehouse full (--overflow).
+// The bench and stress modes always block, as their books count on every item.
+// An item that is not admitted hands its supply ticket back, so a supplier
+// makes another one and the run still ends after --count consumed items.
+#define OVERFLOW_BLOCK 0         // wait for space as long as it takes
+#define OVERFLOW_TIMEOUT 1       // wait at most --overflow-timeout-ms, then drop the rest
+#define OVERFLOW_DROP_NEWEST 2   // drop what does not fit right away
+#define OVERFLOW_DROP_OLDEST 3   // urgent items replace the oldest normal one; normal items wait
+#define OVERFLOW_SPILL 4         // append what does not fit to the spill tier, refilled as space frees up
+#define DEFAULT_OVERFLOW_TIMEOUT_MS 500
+
+struct overflow_counters {
+    atomic_uint_fast64_t waited;       // batches that had to block for space
+    atomic_uint_fast64_t timed_out;    // items dropped after the timeout
+    atomic_uint_fast64_t dropped;      // items refused at once
+    atomic_uint_fast64_t evicted;      // normal items dropped to admit an urgent one
+    atomic_uint_fast64_t spilled;      // items written to the spill tier
+    atomic_uint_fast64_t refilled;     // ... and read back into the warehouse
+};
+
+// The spill tier is a queue of fixed-size segments, files named
+// SPILL_PATH.NNNNNN mapped with MADV_SEQUENTIAL. Suppliers append records at
+// the tail segment and refills read them back in order from the head one, so
+// the disk only ever sees sequential writes and reads and the kernel may
+// write back and drop their pages at will: RAM stays bounded however long a
+// burst lasts. A consumed segment is kept for reuse (up to SPILL_SPARE_SEGMENTS
+// of them) or removed.
+#define DEFAULT_SPILL_SEGMENT_BYTES (4UL << 20)
+#define SPILL_SPARE_SEGMENTS 2
+
+struct spill_record {
+    int item;
+    int priority;
+};
+
+struct spill_segment {
+    struct spill_segment* next;        // towards the tail
+    int fd;
+    unsigned seq;                      // file name suffix
+    struct spill_record* records;      // the mapping
+    size_t written, read;              // records
+};
+
+int overflow_policy = OVERFLOW_BLOCK;
+long overflow_timeout_ms = DEFAULT_OVERFLOW_TIMEOUT_MS;
+struct overflow_counters overflow;
+const char* spill_path = "warehouse.spill";
+size_t spill_segment_bytes = DEFAULT_SPILL_SEGMENT_BYTES;
+size_t spill_segment_records;
+int spill_enabled = 0;
+pthread_mutex_t spill_lock = PTHREAD_MUTEX_INITIALIZER;
+struct spill_segment* spill_head;       // the segment refills read from; under spill_lock
+struct spill_segment* spill_tail;       // the one appended to
+struct spill_segment* spill_spare;      // consumed segments kept for reuse
+int spill_spares;
+unsigned spill_next_seq;
+uint64_t spill_segments_created, spill_segments_recycled;
+atomic_int spill_pending;               // records in the segments
+
+// Snapshots (--snapshot): the stock, spilled items included, and the run's
+// counters go to one compact file, every snapshot_ms and once more at the end.
+// The file is built in memory, written with a single write and fsync'd under
+// a temporary name, then renamed over the previous one, so a crash leaves
+// either the old snapshot or the new one. --restore maps it back in and stocks
+// the warehouse before any thread starts. A snapshot taken while the threads
+// run collects every credit of the warehouse first: once it holds them all,
+// no hand-off is half done and the queues can be read as they are.
+#define SNAPSHOT_MAGIC 0x57485331        // "WHS1"
+#define DEFAULT_SNAPSHOT_MS 5000
+
+struct snapshot_header {
+    uint32_t magic;
+    uint32_t levels;                   // --levels it was taken with
+    uint64_t items;                    // spill records following the header
+    uint64_t remaining;                // items the run still had to consume
+    uint64_t produced, consumed;       // totals so far, across restores
+    uint64_t wall_ns;                  // when it was taken
+};
+
+const char* snapshot_path = NULL;
+long snapshot_ms = DEFAULT_SNAPSHOT_MS;
+const char* restore_path = NULL;
+struct snapshot_header* restore_map;   // the mapped --restore file, until the warehouse is stocked
+size_t restore_bytes;
+uint64_t restored_items, restored_produced, restored_consumed;
+double restore_ms;
+int snapshot_run_count;                // items this run set out to consume
+uint64_t snapshots_written, snapshot_last_items, snapshot_pause_max_ns;
+pthread_t snapshot_thread;
+int snapshot_thread_started = 0;
+// While a live snapshot holds the credits, a supplier that finds no space
+// must not take that for a full warehouse. Overflow policies run between
+// overflow_enter and overflow_leave, and the snapshot waits for the ones
+// already running before it copies the stock.
+atomic_int snapshot_epoch;             // futex word, odd during a live snapshot
+atomic_int overflow_inflight;          // suppliers applying an overflow policy right now
+
+// Task engine (--tasks=W): suppliers and retailers become small state
+// machines run by W worker threads instead of one thread each, so a run can
+// model thousands of stores that mostly sit idle. A task runs until it would
+// sleep or block and then says what it waits for: a sleep goes on the timer
+// wheel, a missing credit puts it on that credit's wait list, which
+// fsem_post_n hands back to the workers as credits come in. The workload
+// thread-locals (random stream, burst state, WRR position) are swapped in and
+// out around every step, so each actor keeps its own.
+#define TASK_WHEEL_SLOTS 1024          // one tick each; longer sleeps go around in rounds
+#define TASK_TICK_NS 1000000ULL
+#define TASK_RUN 0                     // what a step returns: run again (behind the others)
+#define TASK_SLEEP 1                   // ... after sleep_ms
+#define TASK_WAIT 2                    // ... once wait_on has credits
+#define TASK_DONE 3
+
+// Where a task's next step resumes
+#define TASK_AT_CLAIM 0
+#define TASK_AT_PRODUCED 1
+#define TASK_AT_PUT 2
+#define TASK_AT_TAKE 3
+#define TASK_AT_CONSUMED 4
+#define TASK_AT_RESTED 5
+
+struct task {
+    struct task* next;                 // run queue, wheel slot or wait list
+    int retailer;                      // role
+    int id;                            // 1-based, like the thread ids
+    int at;                            // TASK_AT_*
+    int batch, stored;                 // supplier: tickets claimed, items in so far
+    int owed, taken;                   // retailer: tickets left, items in hand
+    int depth;
+    double sleep_ms;
+    struct fsem* wait_on;
+    unsigned rounds;                   // wheel turns left before the slot fires
+    struct pcg32 rng;                  // the actor's thread-locals between steps
+    int burst_on;
+    double burst_left_ms;
+    int wrr_rank;
+    long wrr_left;
+    int* items;                        // batch items (then priorities and descriptors for suppliers)
+};
+
+struct task_list {
+    struct task* head;
+    struct task* tail;
+};
+
+struct task_waiters {
+    pthread_mutex_t lock;
+    struct task_list list;
+    atomic_int count;                  // checked by posters before taking the lock
+};
+
+int task_workers = 0;
+pthread_mutex_t task_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t task_ready = PTHREAD_COND_INITIALIZER;
+struct task_list task_queue;           // runnable tasks, under task_lock
+atomic_int tasks_alive;
+pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+struct task_list task_wheel[TASK_WHEEL_SLOTS];
+uint64_t wheel_tick;                   // last tick expired, under wheel_lock
+uint64_t wheel_origin_ns;
+struct task_waiters space_waiters = {.lock = PTHREAD_MUTEX_INITIALIZER};
+struct task_waiters stock_waiters = {.lock = PTHREAD_MUTEX_INITIALIZER};
+pthread_t* task_threads;
+pthread_t task_ticker;
+atomic_uint_fast64_t task_steps, task_waits;
+
+// Sharding (--shards=N): N independent warehouses, each with its own credits,
+// lock and level queues, so threads on different shards share no lines.
+// Suppliers route each item by a consistent hash of its id; a retailer serves
+// its home shard and, when that is empty, steals from the fullest other one.
+// shard_enter swaps a thread's warehouse/level_slots/level_rings views; between
+// operations every thread is back on shard 0, which holds the claim tickets.
+#define SHARD_VNODES 64                // points per shard on the hash ring
+#define SHARD_STEAL_POLL_MS 50         // how often an idle retailer looks at the other shards
+
+struct shard_point {
+    uint32_t hash;
+    int shard;
+};
+
+struct shard_counters {
+    CACHE_ALIGNED atomic_uint_fast64_t stored;   // items routed here
+    atomic_uint_fast64_t taken;                  // items taken out, by any retailer
+    atomic_uint_fast64_t stolen;                 // ... of which by retailers of other shards
+};
+
+int shard_count = 1;
+struct shard_point shard_ring[MAX_SHARDS * SHARD_VNODES];   // sorted by hash
+int shard_points;
+struct shard_counters shard_counters[MAX_SHARDS];
+__thread int my_shard;                 // the shard warehouse points at
+__thread int home_shard;               // a retailer's own shard
+
+// Per-run benchmark state; items are indexes into bench_stamps
+atomic_long bench_next_item;
+atomic_long bench_next_take;
+uint64_t* bench_stamps;
 
 // Function prototypes
-void refresh_screen();
+void refresh_screen(const struct ui_snapshot* now, const struct ui_snapshot* prev);
+void take_ui_snapshot(struct ui_snapshot* snap);
+void format_last_action(uint64_t action, char* text, size_t size);
+void* ui_main(void* arg);
+void start_ui();
+void stop_ui();
+void start_autoscale();
+void stop_autoscale();
+void* autoscale_main(void* arg);
+void scale_park(atomic_int* active, int id, atomic_int* tickets);
+void scale_release();
+const char* overflow_name(int policy);
+int admit_products(const int* items, const int* priorities, int count, int* depth);
+int evict_normal_for(int item, int priority);
+void spill_open();
+void spill_close();
+void spill_append(const int* items, const int* priorities, int count);
+void spill_refill();
+struct spill_segment* spill_segment_get();
+void spill_segment_put(struct spill_segment* seg);
+int payload_item(int descriptor);
+size_t snapshot_collect(struct spill_record* out);
+void snapshot_take(int live);
+int overflow_enter(int seen);
+void overflow_leave();
+void* snapshot_main(void* arg);
+void start_snapshots();
+void stop_snapshots();
+void restore_load();
+void restore_stock();
+void wait_hist_record(struct wait_hist* h, uint64_t ns);
+void start_metrics();
+void stop_metrics();
+void* metrics_main(void* arg);
+size_t format_metrics(char* out, size_t size);
 void log_error(const char* error);
-void update_statistics(int produced, int consumed);
+void init_statistics();
+void update_statistics(struct thread_stats* shard, int produced, int consumed);
+uint64_t stats_total(struct thread_stats* shards, int count, int consumed_side);
+void stats_range(struct thread_stats* shards, int count, int consumed_side, uint64_t* min, uint64_t* max);
 void* supplier(void* arg);
+void payload_init(int arenas);
+void payload_destroy();
+int payload_make(int item);
+int payload_consume(int descriptor);
+void pcg32_seed(struct pcg32* rng, uint64_t seed, uint64_t stream);
+uint32_t pcg32_next(struct pcg32* rng);
+uint32_t pcg32_bounded(struct pcg32* rng, uint32_t bound);
+double pcg32_unit(struct pcg32* rng);
+void workload_init();
+double next_arrival_ms(struct pcg32* rng);
+int next_item(struct pcg32* rng);
+int next_priority(struct pcg32* rng);
+void sleep_ms(double ms);
 void* retailer(void* arg);
 void add_product(int item, int priority);
 int extract_product();
+int put_product(int item, int priority);
+int take_product(int* depth);
+int put_products(const int* items, const int* priorities, int count, int* depth);
+int take_products(int* items, int max, int* depth);
+int normal_stock();
+int urgent_stock();
+int level_stock(int rank);
+int pick_level(unsigned mask, long* quota);
+uint64_t level_head_stamp(int rank);
+void level_mark_stocked(int rank);
+void level_maybe_empty(int rank);
+void* alloc_slots(size_t bytes);
+void free_slots(void* mem, size_t bytes);
+size_t round_up_pow2(size_t n);
+void ring_init(struct mpmc_ring* r, size_t min_size);
+void ring_destroy(struct mpmc_ring* r);
+int ring_push(struct mpmc_ring* r, int item, uint64_t stamp);
+int ring_pop(struct mpmc_ring* r, int* item);
+void ring_push_n(struct mpmc_ring* r, const int* items, int count, uint64_t stamp);
+int ring_pop_n(struct mpmc_ring* r, int* items, int max);
+size_t ring_count(struct mpmc_ring* r);
+const char* engine_name(int engine);
+void steal_attach();
+int steal_route_pick();
+void deque_push_n(struct steal_deque* d, const int* items, int count, uint64_t stamp);
+int deque_take_n(struct steal_deque* d, int* items, int max);
+size_t deque_count(struct steal_deque* d);
+int steal_take(int* items, int max);
+int steal_take_from(struct retailer_deques* rd, int* items, int max);
+void numa_init();
+int parse_cpu_list(const char* text, int* cpus, int max_cpus);
+int current_node();
+int resolve_mem_node();
+void bind_to_node(void* mem, size_t bytes, int node, unsigned flags);
+void spawn_thread(pthread_t* thread, const int* cpus, int cpu_count, int index, void* (*fn)(void*), void* arg);
+void init_warehouse();
+void destroy_warehouse();
+int shm_segment_live();
+void shm_attach();
+int claim_tickets(atomic_int* tickets, int want, int* held);
+void return_tickets(atomic_int* tickets, int count, int* held);
+void shm_detach();
+int shm_live_processes(struct shm_header* header);
+void shm_reap();
+void shm_recover();
+int shm_put_products(const int* items, const int* priorities, int count, int* depth);
+int shm_take_products(int* items, int max, int* depth);
+void fsem_wait_nonzero(struct fsem* s);
+static void lock_warehouse();
+static void unlock_warehouse();
+uint64_t now_ns();
+void hist_record(struct lat_hist* h, uint64_t value);
+void hist_merge(struct lat_hist* dst, const struct lat_hist* src);
+uint64_t hist_percentile(const struct lat_hist* h, double pct);
+#ifdef WAREHOUSE_INSTRUMENT
+uint64_t instr_now();
+void instr_init();
+void instr_record(int site, uint64_t ticks);
+#endif
+void instr_report();
+void trace_init();
+void trace_attach(const char* role, int id);
+static inline uint64_t trace_begin(int kind);
+static inline void trace_end(int kind, uint64_t start, int items);
+void trace_record(int kind, uint64_t start, int items);
+void trace_write();
+void* bench_supplier(void* arg);
+void* bench_retailer(void* arg);
+int perf_counter_open(uint32_t type, uint64_t config);
+long long perf_counter_stop(int fd);
+double bench_run_one(int first_row, long capacity, int producers, int consumers, double baseline_rate);
+void run_benchmark();
+void* stress_supplier(void* arg);
+void* stress_retailer(void* arg);
+int stress_run_one(int producers, int consumers);
+int run_stress();
+int replay_open(struct replay_source* src, const char* path);
+int replay_read(struct replay_source* src, struct replay_event* out, int max);
+int run_replay(int count, char** paths);
+int fetch_products(int* items, int got, int* depth);
+void task_list_push(struct task_list* l, struct task* t);
+void task_runnable(struct task_list* chain);
+void task_sleep(struct task* t);
+void task_park(struct task* t);
+void task_wake(struct fsem* s, int n);
+void task_flush(int phase);
+int supplier_step(struct task* t);
+int retailer_step(struct task* t);
+void task_finish(struct task* t);
+void* task_worker(void* arg);
+void* task_ticker_main(void* arg);
+void start_tasks();
+void stop_tasks();
+uint32_t shard_hash(uint32_t x);
+void shard_ring_init();
+int shard_of(int item);
+void shard_enter(int s);
+int shard_level_stock(int s, int rank);
+int stock_total();
+int shards_depth();
+void route_batch(int* items, int* priorities, int count, int* counts);
+int shard_admit(const int* items, const int* priorities, int count, const int* counts, int* depth);
+int shard_take(int* items, int max, int* depth);
+void init_shard();
+void destroy_shard();
+int parse_count(const char* text, unsigned long long* value);
+int parse_list(const char* text, long* values, int max_values);
+void parse_args(int argc, char* argv[]);
+char** merge_config_args(int* argc, char* argv[]);
+int parse_positive(const char* text, const char* what);
 void print_final_statistics();  
 void open_log_file();
 void close_log_file();
-void log_event_file(const char* event, int id, int item, const char* type);
+void log_event(int event, int id, int item, int priority, int depth);
+int64_t clock_offset_ns();
+void segment_open_next(unsigned first_seq);
+void segment_close();
+void segment_append(const struct log_record* records, size_t count);
+size_t format_log_record(char* out, size_t size, const struct log_record* r, int64_t offset_ns, int format);
+int read_event_file(const char* path, int format);
+struct log_buffer* log_buffer_register();
+void* logger_main(void* arg);
+size_t logger_drain(struct log_record* batch, char* out, size_t* pending);
 void sigint_handler(int sig);
+void install_signal_handlers();
+void notify_coordinator();
+void begin_shutdown(int phase);
+void coordinate_shutdown(pthread_t* prod_threads, pthread_t* cons_threads);
+static long futex(atomic_int* addr, int op, int value);
+void fsem_init(struct fsem* s, int value);
+int fsem_take(struct fsem* s, int n);
+int fsem_wait_upto(struct fsem* s, int n);
+int fsem_wait_upto_ms(struct fsem* s, int n, long timeout_ms);
+void store_products(const int* items, const int* priorities, int got, int* depth);
+void fsem_post_n(struct fsem* s, int n);
+int fsem_value(struct fsem* s);
+void print_wait_statistics(const char* name, struct fsem* s);
 
-void refresh_screen() {
-    clear();
-    box(stdscr, 0, 0);
-
-    mvprintw(1, 2, "Warehouse Simulation (Suppliers: %d, Retailers: %d)", NUM_PRODUCERS, NUM_CONSUMERS);
-    mvprintw(3, 2, "Normal Items in Buffer: %d", (in - out + BUFFER_SIZE) % BUFFER_SIZE);
-    mvprintw(4, 2, "Urgent Items in Buffer: %d", urgent_count);
-    mvprintw(6, 2, "Total Produced: %d", total_produced);
-    mvprintw(7, 2, "Total Consumed: %d", total_consumed);
-    mvprintw(9, 2, "Last Action: %s", last_action);
+// Print one screen line, padded so that stale text is overwritten without
+// clearing (and redrawing) the whole screen
+static void draw_field(int row, const char* fmt, ...) {
+    char text[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    int width = COLS - 4 > 0 ? COLS - 4 : 0;
+    mvprintw(row, 2, "%-*.*s", width, width, text);
+}
 
-    int normal_count = (in - out + BUFFER_SIZE) % BUFFER_SIZE;
-    int total_stock = normal_count + urgent_count;
+// Draw everything when prev is NULL, otherwise only the fields that changed
+void refresh_screen(const struct ui_snapshot* now, const struct ui_snapshot* prev) {
+    if (!prev) {
+        clear();
+        box(stdscr, 0, 0);
+        draw_field(1, "Warehouse Simulation (Suppliers: %d, Retailers: %d, Engine: %s)", NUM_PRODUCERS, NUM_CONSUMERS,
+                   engine_name(queue_engine));
+        if (shard_count > 1)
+            draw_field(2, "Buffer Capacity: %zu slots in each of %d shards", buffer_capacity, shard_count);
+        else
+            draw_field(2, "Buffer Capacity: %zu slots", buffer_capacity);
+    }
+    if (!prev || now->normal != prev->normal)
+        draw_field(3, "Normal Items in Buffer: %d", now->normal);
+    if (!prev || now->urgent != prev->urgent)
+        draw_field(4, "Urgent Items in Buffer: %d", now->urgent);
+    if (priority_levels > 2 && (!prev || memcmp(now->levels, prev->levels, sizeof(now->levels)) != 0)) {
+        char text[256];
+        size_t used = 0;
+        for (int r = 0; r < priority_levels && used < sizeof(text); r++)
+            used += snprintf(text + used, sizeof(text) - used, " p%d=%d", priority_levels - 1 - r, now->levels[r]);
+        draw_field(5, "Per level:%s", text);
+    }
+    if (shard_count > 1 && (!prev || memcmp(now->shards, prev->shards, sizeof(now->shards)) != 0 ||
+                            now->stolen != prev->stolen)) {
+        char text[256];
+        size_t used = 0;
+        for (int s = 0; s < shard_count && used < sizeof(text); s++)
+            used += snprintf(text + used, sizeof(text) - used, " s%d=%d", s, now->shards[s]);
+        draw_field(8, "Per shard:%s (%llu stolen)", text, (unsigned long long)now->stolen);
+    }
+    if (!prev || now->produced != prev->produced || now->supplier_min != prev->supplier_min ||
+        now->supplier_max != prev->supplier_max)
+        draw_field(6, "Total Produced: %llu (per supplier min %llu / max %llu)", (unsigned long long)now->produced,
+                   (unsigned long long)now->supplier_min, (unsigned long long)now->supplier_max);
+    if (!prev || now->consumed != prev->consumed || now->retailer_min != prev->retailer_min ||
+        now->retailer_max != prev->retailer_max)
+        draw_field(7, "Total Consumed: %llu (per retailer min %llu / max %llu)", (unsigned long long)now->consumed,
+                   (unsigned long long)now->retailer_min, (unsigned long long)now->retailer_max);
+    if (!prev || now->action != prev->action) {
+        char text[100];
+        format_last_action(now->action, text, sizeof(text));
+        draw_field(9, "Last Action: %s", text);
+    }
 
-    if (total_stock <= LOW_STOCK_THRESHOLD) {
-        mvprintw(11, 2, "[STOCK ALERT] LOW stock: %d items!", total_stock);
-    } else if (total_stock >= HIGH_STOCK_THRESHOLD) {
-        mvprintw(11, 2, "[STOCK ALERT] HIGH stock: %d items!", total_stock);
+    int total_stock = now->normal + now->urgent;
+    if (!prev || total_stock != prev->normal + prev->urgent) {
+        if (total_stock <= LOW_STOCK_THRESHOLD) {
+            draw_field(11, "[STOCK ALERT] LOW stock: %d items!", total_stock);
+        } else if (total_stock >= HIGH_STOCK_THRESHOLD) {
+            draw_field(11, "[STOCK ALERT] HIGH stock: %d items!", total_stock);
+        } else {
+            draw_field(11, "");
+        }
     }
+    if (autoscale && (!prev || now->active_suppliers != prev->active_suppliers ||
+                      now->active_retailers != prev->active_retailers))
+        draw_field(10, "Autoscale: %d/%d suppliers, %d/%d retailers active", now->active_suppliers, NUM_PRODUCERS,
+                   now->active_retailers, NUM_CONSUMERS);
+    if (!prev || now->shutdown != prev->shutdown)
+        draw_field(12, "%s", now->shutdown == SHUTDOWN_DRAIN ? "Shutting down: draining stock (Ctrl+C again to abort)" : "");
     refresh();
 }
 
-void print_final_statistics() {
-    printf("\nSimulation ended.\n");
-    printf("Final statistics:\n");
-    printf("Total Produced: %d, Total Consumed: %d\n", total_produced, total_consumed);
-    printf("Final stock status: Normal items = %d, Urgent items = %d\n", (in - out + BUFFER_SIZE) % BUFFER_SIZE, urgent_count);
+// Lock-free: every field is an atomic load, so observers never slow the workers down
+void take_ui_snapshot(struct ui_snapshot* snap) {
+    memset(snap->levels, 0, sizeof(snap->levels));
+    memset(snap->shards, 0, sizeof(snap->shards));
+    snap->stolen = 0;
+    for (int s = 0; s < shard_count; s++) {
+        for (int r = 0; r < priority_levels; r++) {
+            int n = shard_level_stock(s, r);
+            snap->levels[r] += n;
+            snap->shards[s] += n;
+        }
+        snap->stolen += atomic_load_explicit(&shard_counters[s].stolen, memory_order_relaxed);
+    }
+    snap->normal = snap->levels[LEVEL_RANK(0)];
+    snap->urgent = 0;
+    for (int r = 0; r < priority_levels - 1; r++) snap->urgent += snap->levels[r];
 
-    printf("Exiting program...\n");
-    fflush(stdout);
-    sleep(1); // Give time for logs to flush
-    printf("Goodbye!\n");
-    fflush(stdout);
-    sleep(1); // Give time for logs to flush
+    snap->produced = stats_total(supplier_stats, NUM_PRODUCERS, 0);
+    snap->consumed = stats_total(retailer_stats, NUM_CONSUMERS, 1);
+    stats_range(supplier_stats, NUM_PRODUCERS, 0, &snap->supplier_min, &snap->supplier_max);
+    stats_range(retailer_stats, NUM_CONSUMERS, 1, &snap->retailer_min, &snap->retailer_max);
+    snap->action = atomic_load_explicit(&last_action, memory_order_relaxed);
+    snap->shutdown = atomic_load_explicit(&shutdown_phase, memory_order_relaxed);
+    snap->active_suppliers = atomic_load_explicit(&active_suppliers, memory_order_relaxed);
+    snap->active_retailers = atomic_load_explicit(&active_retailers, memory_order_relaxed);
 }
 
-// Signal handler for Ctrl+C
-void sigint_handler(int sig) {
+void format_last_action(uint64_t action, char* text, size_t size) {
+    int kind = (int)(action >> 57);
+    int priority = (int)(action >> 52) & 0x1F;
+    int id = (int)(action >> 32) & 0xFFFFF;
+    int item = (int)(uint32_t)action;
 
-    simulation_running = 0;
-    endwin(); // End ncurses mode
+    if (kind == ACTION_PRODUCED && priority > 1)
+        snprintf(text, size, "Supplier %d produced item -> [%d] (PRIORITY %d)", id, item, priority);
+    else if (kind == ACTION_PRODUCED)
+        snprintf(text, size, "Supplier %d produced item -> [%d] %s", id, item, priority ? "(PRIORITY)" : "");
+    else if (kind == ACTION_CONSUMED)
+        snprintf(text, size, "Retailer %d consumed item -> [%d]", id, item);
+    else
+        snprintf(text, size, "Waiting...");
+}
 
-    printf("\n\nSignal handler triggered!\n");
-    printf("\nCaught signal %d (Ctrl+C). Exiting simulation...\n", sig);
-    fflush(stdout);
+// The only thread that talks to ncurses once the simulation is running
+void* ui_main(void* arg) {
+    (void)arg;
+    struct ui_snapshot now, prev;
+    int first = 1;
+    struct timespec period = {0, 1000000000L / ui_hz};
+    if (ui_hz == 1) period = (struct timespec){1, 0};
 
-    // Set simulation_count to 0 to signal threads to exit
-    pthread_mutex_lock(&mutex);
-    simulation_count = 0;
-    pthread_mutex_unlock(&mutex);
+    while (!atomic_load(&ui_stop) && simulation_running) {
+        take_ui_snapshot(&now);
+        refresh_screen(&now, first ? NULL : &prev);
+        prev = now;
+        first = 0;
+        nanosleep(&period, NULL);
+    }
+    return NULL;
+}
 
-    // Unblock any threads waiting on semaphores
-    for (int i = 0; i < NUM_PRODUCERS; i++) sem_post(&empty);
-    for (int i = 0; i < NUM_CONSUMERS; i++) sem_post(&full);
+void start_ui() {
+    atomic_store(&ui_stop, 0);
+    spawn_thread(&ui_thread, NULL, 0, 0, ui_main, NULL);
+}
 
-    print_final_statistics();
-    close_log_file(); 
+void stop_ui() {
+    atomic_store(&ui_stop, 1);
+    pthread_join(ui_thread, NULL);
+}
 
-    exit(0);
+// Park the calling thread while it is beyond its role's active count and
+// there is still work to claim; returns at once without --autoscale
+void scale_park(atomic_int* active, int id, atomic_int* tickets) {
+    if (!autoscale) return;
+    struct retailer_deques* own = queue_engine == ENGINE_STEAL && my_retailer >= 0 && active == &active_retailers
+                                  ? &steal_deques[my_retailer] : NULL;
+    for (;;) {
+        int epoch = atomic_load(&scale_epoch);
+        if (id <= atomic_load(active) || atomic_load(tickets) <= 0 ||
+            atomic_load(&shutdown_phase) != SHUTDOWN_NONE)
+            break;
+        if (own) atomic_store(&own->parked, 1);
+        futex(&scale_epoch, FUTEX_WAIT_PRIVATE, epoch);
+    }
+    if (own) atomic_store(&own->parked, 0);
 }
 
-void log_error(const char* error) {
-    printf("[ERROR] %s\n", error);
+// Make every parked thread look at its condition again
+void scale_release() {
+    if (!autoscale) return;
+    atomic_fetch_add(&scale_epoch, 1);
+    futex(&scale_epoch, FUTEX_WAKE_PRIVATE, INT_MAX);
 }
 
-void update_statistics(int produced, int consumed) {
-    total_produced += produced;
-    total_consumed += consumed;
+// Move one role's active count a step in the direction want points to, once
+// it has pointed there for autoscale_hold ticks in a row
+static void scale_step(atomic_int* active, int pool, int want, struct scale_streak* streak) {
+    if (want != streak->sign) {
+        streak->sign = want;
+        streak->ticks = 0;
+    }
+    if (want == 0 || ++streak->ticks < autoscale_hold) return;
+    streak->ticks = 0;
+    int now = atomic_load(active), next = now + want;
+    if (next < 1 || next > pool) return;
+    atomic_store(active, next);
+    atomic_fetch_add(&scale_changes, 1);
+    if (want > 0) scale_release();
 }
 
-FILE* log_fp = NULL;
+// Controller thread: one decision per autoscale_ms until the shutdown starts
+void* autoscale_main(void* arg) {
+    (void)arg;
+    struct scale_streak suppliers = {0, 0}, retailers = {0, 0};
+    uint64_t consumed = stats_total(retailer_stats, NUM_CONSUMERS, 1);
+    while (atomic_load(&shutdown_phase) == SHUTDOWN_NONE) {
+        sleep_ms(autoscale_ms);
+        if (atomic_load(&shutdown_phase) != SHUTDOWN_NONE) break;
+        int depth = normal_stock() + urgent_stock();
+        uint64_t total = stats_total(retailer_stats, NUM_CONSUMERS, 1);
+        uint64_t rate = total - consumed;      // items per tick
+        consumed = total;
+        // Little's law; stock that does not move at all counts as late
+        int late = depth > 0 && (rate == 0 || (uint64_t)depth * autoscale_ms / rate > (uint64_t)autoscale_latency_ms);
 
-void open_log_file() {
-    log_fp = fopen("warehouse.log", "a");
-    if (!log_fp) {
-        printf("[ERROR] Could not open log file!\n");
-        exit(1);
+        int want_retailers = late || depth >= HIGH_STOCK_THRESHOLD ? 1 : depth <= LOW_STOCK_THRESHOLD ? -1 : 0;
+        int want_suppliers = depth <= LOW_STOCK_THRESHOLD ? 1 : depth >= HIGH_STOCK_THRESHOLD ? -1 : 0;
+        scale_step(&active_retailers, NUM_CONSUMERS, want_retailers, &retailers);
+        scale_step(&active_suppliers, NUM_PRODUCERS, want_suppliers, &suppliers);
     }
+    return NULL;
 }
 
-void close_log_file() {
-    if (log_fp) fclose(log_fp);
+// Every thread starts active; the controller only runs with --autoscale
+void start_autoscale() {
+    atomic_store(&active_suppliers, NUM_PRODUCERS);
+    atomic_store(&active_retailers, NUM_CONSUMERS);
+    if (autoscale) spawn_thread(&autoscale_thread, NULL, 0, 0, autoscale_main, NULL);
 }
 
-void log_event_file(const char* event, int id, int item, const char* type) {
-    if (!log_fp) return;
+void stop_autoscale() {
+    if (autoscale) pthread_join(autoscale_thread, NULL);
+}
 
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
+void wait_hist_record(struct wait_hist* h, uint64_t ns) {
+    int bucket = ns <= (1ULL << WAIT_HIST_SHIFT) ? 0 : 64 - __builtin_clzll(ns - 1) - WAIT_HIST_SHIFT;
+    if (bucket >= WAIT_HIST_BUCKETS) bucket = WAIT_HIST_BUCKETS - 1;
+    atomic_fetch_add_explicit(&h->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum_ns, ns, memory_order_relaxed);
+}
 
-    fprintf(log_fp, "[%04d-%02d-%02d %02d:%02d:%02d] [LOG] %s: Thread %d %s item %d\n",
-        t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
-        t->tm_hour, t->tm_min, t->tm_sec,
-        event, id, type, item);
-    fflush(log_fp);
+// Listen for scrapes on metrics_addr:metrics_port
+void start_metrics() {
+    if (metrics_port <= 0) return;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(metrics_port);
+    if (inet_pton(AF_INET, metrics_addr, &addr.sin_addr) != 1) {
+        printf("[ERROR] Invalid metrics address %s!\n", metrics_addr);
+        exit(1);
+    }
+    int one = 1;
+    metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (metrics_fd < 0 || setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+        bind(metrics_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(metrics_fd, 16) != 0) {
+        printf("[ERROR] Could not listen on %s:%d: %s\n", metrics_addr, metrics_port, strerror(errno));
+        exit(1);
+    }
+    atomic_store(&metrics_stop, 0);
+    spawn_thread(&metrics_thread, NULL, 0, 0, metrics_main, NULL);
 }
 
-// Producer thread function
-void* supplier(void* arg) {
-    int id = (long)arg;
-    while (1) {
-        pthread_mutex_lock(&mutex);
-        if (simulation_count <= 0) {
-            pthread_mutex_unlock(&mutex);
-            break;
-        }
-        pthread_mutex_unlock(&mutex);
+void stop_metrics() {
+    if (metrics_fd < 0) return;
+    atomic_store(&metrics_stop, 1);
+    pthread_join(metrics_thread, NULL);
+    close(metrics_fd);
+    metrics_fd = -1;
+}
 
-        int item = rand() % 100;
-        int priority = rand() % MAX_PRIORITY;
-        sleep(1);
+// Serve one request per connection: GET /metrics gets the text exposition
+// format, anything else a 404
+void* metrics_main(void* arg) {
+    (void)arg;
+    static char body[METRICS_BUFFER_SIZE];
+    char request[2048], header[256];
+    struct pollfd listener = {.fd = metrics_fd, .events = POLLIN};
 
-        sem_wait(&empty);
-        pthread_mutex_lock(&mutex);
+    while (!atomic_load(&metrics_stop)) {
+        if (poll(&listener, 1, 200) <= 0) continue;
+        int client = accept4(metrics_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0) continue;
 
-        add_product(item, priority);
+        // Never let a slow client hold the exporter for long
+        struct timeval timeout = {.tv_sec = 1, .tv_usec = 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        ssize_t got = 0, n;
+        while (got < (ssize_t)sizeof(request) - 1 &&
+               (n = read(client, request + got, sizeof(request) - 1 - got)) > 0) {
+            got += n;
+            request[got] = '\0';
+            if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+        }
+        request[got > 0 ? got : 0] = '\0';
 
-        snprintf(last_action, sizeof(last_action), "Supplier %d produced item -> [%d] %s", id, item, priority ? "(PRIORITY)" : "");
-        if (simulation_running) {
-            refresh_screen();
+        size_t length = 0;
+        int found = strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0;
+        if (found) length = format_metrics(body, sizeof(body));
+        int header_length = snprintf(header, sizeof(header),
+                                     "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                     "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                                     found ? "200 OK" : "404 Not Found", length);
+        if (write(client, header, header_length) == header_length && length > 0) {
+            for (size_t sent = 0; sent < length && (n = write(client, body + sent, length - sent)) > 0;) sent += n;
         }
+        close(client);
+    }
+    return NULL;
+}
 
-        log_event_file("Produced", id, item, priority ? "(PRIORITY)" : "");
+static size_t format_wait_hist(char* out, size_t size, const char* name, const char* labels, struct wait_hist* h) {
+    size_t used = 0;
+    uint64_t cumulative = 0;
+    const char* sep = labels[0] ? "," : "";
+    for (int b = 0; b < WAIT_HIST_BUCKETS - 1 && used < size; b++) {
+        cumulative += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        used += snprintf(out + used, size - used, "%s_bucket{%s%sle=\"%.9g\"} %llu\n", name, labels, sep,
+                         (double)(1ULL << (b + WAIT_HIST_SHIFT)) / 1e9, (unsigned long long)cumulative);
+    }
+    // Read count after the buckets so that +Inf never ends up below a finite bucket
+    uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    if (count < cumulative) count = cumulative;
+    if (used < size)
+        used += snprintf(out + used, size - used, "%s_bucket{%s%sle=\"+Inf\"} %llu\n%s_sum{%s} %.9f\n%s_count{%s} %llu\n",
+                         name, labels, sep, (unsigned long long)count, name, labels,
+                         (double)atomic_load_explicit(&h->sum_ns, memory_order_relaxed) / 1e9,
+                         name, labels, (unsigned long long)count);
+    return used < size ? used : size;
+}
 
-        update_statistics(1, 0);
+// Render the current state in the Prometheus text format. Everything is read
+// with plain atomic loads, the same way the UI snapshot is taken.
+size_t format_metrics(char* out, size_t size) {
+    struct ui_snapshot snap;
+    take_ui_snapshot(&snap);
+    int total_stock = snap.normal + snap.urgent;
+    size_t used = 0;
 
-        pthread_mutex_unlock(&mutex);
-        sem_post(&full);
+#define METRIC(...) do { if (used < size) used += snprintf(out + used, size - used, __VA_ARGS__); } while (0)
+    METRIC("# HELP warehouse_produced_total Items produced by all suppliers.\n"
+           "# TYPE warehouse_produced_total counter\nwarehouse_produced_total %llu\n",
+           (unsigned long long)snap.produced);
+    METRIC("# HELP warehouse_consumed_total Items consumed by all retailers.\n"
+           "# TYPE warehouse_consumed_total counter\nwarehouse_consumed_total %llu\n",
+           (unsigned long long)snap.consumed);
+    METRIC("# HELP warehouse_queue_depth Items currently stocked.\n"
+           "# TYPE warehouse_queue_depth gauge\n"
+           "warehouse_queue_depth{queue=\"normal\"} %d\nwarehouse_queue_depth{queue=\"urgent\"} %d\n",
+           snap.normal, snap.urgent);
+    METRIC("# HELP warehouse_level_depth Items currently stocked per priority level.\n"
+           "# TYPE warehouse_level_depth gauge\n");
+    for (int r = 0; r < priority_levels; r++)
+        METRIC("warehouse_level_depth{priority=\"%d\"} %d\n", priority_levels - 1 - r, snap.levels[r]);
+    if (shard_count > 1) {
+        METRIC("# HELP warehouse_shard_depth Items currently stocked per shard.\n"
+               "# TYPE warehouse_shard_depth gauge\n");
+        for (int s = 0; s < shard_count; s++)
+            METRIC("warehouse_shard_depth{shard=\"%d\"} %d\n", s, snap.shards[s]);
+        METRIC("# HELP warehouse_shard_stolen_total Items retailers took from a shard other than their own.\n"
+               "# TYPE warehouse_shard_stolen_total counter\nwarehouse_shard_stolen_total %llu\n",
+               (unsigned long long)snap.stolen);
+    }
+    METRIC("# HELP warehouse_capacity Slots shared by all levels.\n"
+           "# TYPE warehouse_capacity gauge\nwarehouse_capacity %zu\n", buffer_capacity);
+    METRIC("# HELP warehouse_stock_threshold Stock levels that raise an alert.\n"
+           "# TYPE warehouse_stock_threshold gauge\n"
+           "warehouse_stock_threshold{alert=\"low\"} %d\nwarehouse_stock_threshold{alert=\"high\"} %d\n",
+           LOW_STOCK_THRESHOLD, HIGH_STOCK_THRESHOLD);
+    METRIC("# HELP warehouse_stock_alert 1 while the stock is at or beyond the threshold.\n"
+           "# TYPE warehouse_stock_alert gauge\n"
+           "warehouse_stock_alert{alert=\"low\"} %d\nwarehouse_stock_alert{alert=\"high\"} %d\n",
+           total_stock <= LOW_STOCK_THRESHOLD, total_stock >= HIGH_STOCK_THRESHOLD);
+    METRIC("# HELP warehouse_active_threads Threads working, the rest parked by the autoscaler.\n"
+           "# TYPE warehouse_active_threads gauge\n"
+           "warehouse_active_threads{role=\"supplier\"} %d\nwarehouse_active_threads{role=\"retailer\"} %d\n",
+           snap.active_suppliers, snap.active_retailers);
+    METRIC("# HELP warehouse_overflow_total Outcomes of batches and items that found the warehouse full.\n"
+           "# TYPE warehouse_overflow_total counter\n"
+           "warehouse_overflow_total{outcome=\"waited\"} %llu\nwarehouse_overflow_total{outcome=\"timed_out\"} %llu\n"
+           "warehouse_overflow_total{outcome=\"dropped\"} %llu\nwarehouse_overflow_total{outcome=\"evicted\"} %llu\n"
+           "warehouse_overflow_total{outcome=\"spilled\"} %llu\nwarehouse_overflow_total{outcome=\"refilled\"} %llu\n",
+           (unsigned long long)atomic_load_explicit(&overflow.waited, memory_order_relaxed),
+           (unsigned long long)atomic_load_explicit(&overflow.timed_out, memory_order_relaxed),
+           (unsigned long long)atomic_load_explicit(&overflow.dropped, memory_order_relaxed),
+           (unsigned long long)atomic_load_explicit(&overflow.evicted, memory_order_relaxed),
+           (unsigned long long)atomic_load_explicit(&overflow.spilled, memory_order_relaxed),
+           (unsigned long long)atomic_load_explicit(&overflow.refilled, memory_order_relaxed));
+    METRIC("# HELP warehouse_spill_pending Items waiting in the spill tier.\n"
+           "# TYPE warehouse_spill_pending gauge\nwarehouse_spill_pending %d\n", atomic_load(&spill_pending));
 
-        sleep(2); // Simulate time taken to produce
+    struct { const char* wait; struct fsem* sem; } sems[] = {{"space", &warehouse->empty}, {"stock", &warehouse->full}};
+    METRIC("# HELP warehouse_parks_total Times a waiter went to sleep on the futex.\n"
+           "# TYPE warehouse_parks_total counter\n");
+    for (int i = 0; i < 2; i++)
+        METRIC("warehouse_parks_total{wait=\"%s\"} %llu\n", sems[i].wait,
+               (unsigned long long)atomic_load_explicit(&sems[i].sem->parks, memory_order_relaxed));
+    METRIC("# HELP warehouse_spurious_wakeups_total Wake-ups that found no credit.\n"
+           "# TYPE warehouse_spurious_wakeups_total counter\n");
+    for (int i = 0; i < 2; i++)
+        METRIC("warehouse_spurious_wakeups_total{wait=\"%s\"} %llu\n", sems[i].wait,
+               (unsigned long long)atomic_load_explicit(&sems[i].sem->spurious, memory_order_relaxed));
+    METRIC("# HELP warehouse_credit_wait_seconds Time waited for a free slot (space) or an item (stock).\n"
+           "# TYPE warehouse_credit_wait_seconds histogram\n");
+    for (int i = 0; i < 2; i++) {
+        char labels[32];
+        snprintf(labels, sizeof(labels), "wait=\"%s\"", sems[i].wait);
+        if (used < size) used += format_wait_hist(out + used, size - used, "warehouse_credit_wait_seconds", labels, &sems[i].sem->wait);
     }
-    return NULL;
+    METRIC("# HELP warehouse_lock_wait_seconds Time blocked on the warehouse mutex when it was contended.\n"
+           "# TYPE warehouse_lock_wait_seconds histogram\n");
+    if (used < size) used += format_wait_hist(out + used, size - used, "warehouse_lock_wait_seconds", "", &lock_wait);
+#undef METRIC
+    return used < size ? used : size;
 }
 
-// Consumer thread function
-void* retailer(void* arg) {
-    int id = (long)arg;
-    while (1) {
-        pthread_mutex_lock(&mutex);
-        if (simulation_count <= 0) {
-            pthread_mutex_unlock(&mutex);
-            break;
+void print_final_statistics() {
+    printf("\nSimulation ended.\n");
+    printf("Final statistics:\n");
+    if (shutdown_report[0]) printf("%s\n", shutdown_report);
+    printf("Workload seed: %llu (repeat with --seed)\n", (unsigned long long)workload_seed);
+    printf("Total Produced: %llu, Total Consumed: %llu\n",
+           (unsigned long long)stats_total(supplier_stats, NUM_PRODUCERS, 0),
+           (unsigned long long)stats_total(retailer_stats, NUM_CONSUMERS, 1));
+    if (supplier_stats && retailer_stats) {
+        for (int i = 0; i < NUM_PRODUCERS; i++)
+            printf("  Supplier %d produced %llu\n", i + 1,
+                   (unsigned long long)atomic_load_explicit(&supplier_stats[i].produced, memory_order_relaxed));
+        for (int i = 0; i < NUM_CONSUMERS; i++) {
+            printf("  Retailer %d consumed %llu", i + 1,
+                   (unsigned long long)atomic_load_explicit(&retailer_stats[i].consumed, memory_order_relaxed));
+            if (queue_engine == ENGINE_STEAL && steal_deques)
+                printf(" (%llu stolen, %llu cross-node)", (unsigned long long)steal_deques[i].stolen,
+                       (unsigned long long)steal_deques[i].stolen_remote);
+            printf("\n");
         }
-        simulation_count--;
-        pthread_mutex_unlock(&mutex);
-        
-        sem_wait(&full);
+    }
+    struct ui_snapshot stock;
+    take_ui_snapshot(&stock);
+    printf("Final stock status: Normal items = %d, Urgent items = %d\n", stock.normal, stock.urgent);
+    if (priority_levels > 2) {
+        for (int r = 0; r < priority_levels; r++)
+            printf("  Priority %d items = %d\n", priority_levels - 1 - r, stock.levels[r]);
+    }
+    for (int s = 0; shard_count > 1 && s < shard_count; s++)
+        printf("  Shard %d: %d items left, %llu stored, %llu taken (%llu by other shards' retailers)\n", s,
+               stock.shards[s], (unsigned long long)atomic_load(&shard_counters[s].stored),
+               (unsigned long long)atomic_load(&shard_counters[s].taken),
+               (unsigned long long)atomic_load(&shard_counters[s].stolen));
 
-        pthread_mutex_lock(&mutex);
-        if (in == out && urgent_count == 0) {
-            pthread_mutex_unlock(&mutex);
-            sem_post(&full);
-            continue; // No items to consume
+    if (shm) {
+        int left = atomic_load(&warehouse->simulation_count);
+        if (left < 0) left = 0;
+        printf("Shared warehouse %s: %d processes attached, %d items left to consume, "
+               "%llu dead processes reaped, %llu lock recoveries\n", shm_name, shm_live_processes(shm), left,
+               (unsigned long long)atomic_load(&shm->reaped), (unsigned long long)atomic_load(&shm->recoveries));
+    }
+    if (overflow_policy != OVERFLOW_BLOCK || atomic_load(&overflow.waited))
+        printf("Overflow (%s): %llu batches waited, %llu timed out, %llu dropped, %llu evicted, "
+               "%llu spilled, %llu refilled, %d left in the spill tier\n", overflow_name(overflow_policy),
+               (unsigned long long)atomic_load(&overflow.waited), (unsigned long long)atomic_load(&overflow.timed_out),
+               (unsigned long long)atomic_load(&overflow.dropped), (unsigned long long)atomic_load(&overflow.evicted),
+               (unsigned long long)atomic_load(&overflow.spilled), (unsigned long long)atomic_load(&overflow.refilled),
+               atomic_load(&spill_pending));
+    if (spill_segments_created)
+        printf("Spill tier: %llu segments of %zu bytes created, %llu reused\n",
+               (unsigned long long)spill_segments_created, spill_segment_bytes,
+               (unsigned long long)spill_segments_recycled);
+    if (restore_path)
+        printf("Restored %llu items from %s in %.1f ms (%llu produced / %llu consumed before)\n",
+               (unsigned long long)restored_items, restore_path, restore_ms, (unsigned long long)restored_produced,
+               (unsigned long long)restored_consumed);
+    if (snapshot_path)
+        printf("Snapshots: %llu written to %s, the last with %llu items; longest pause %.2f ms\n",
+               (unsigned long long)snapshots_written, snapshot_path, (unsigned long long)snapshot_last_items,
+               snapshot_pause_max_ns / 1e6);
+    if (task_workers)
+        printf("Tasks: %d suppliers and %d retailers on %d workers, %llu steps, %llu waits for credits\n",
+               NUM_PRODUCERS, NUM_CONSUMERS, task_workers, (unsigned long long)atomic_load(&task_steps),
+               (unsigned long long)atomic_load(&task_waits));
+    if (autoscale)
+        printf("Autoscale: %llu changes, ended with %d/%d suppliers and %d/%d retailers active\n",
+               (unsigned long long)atomic_load(&scale_changes), atomic_load(&active_suppliers), NUM_PRODUCERS,
+               atomic_load(&active_retailers), NUM_CONSUMERS);
+    if (payload_max && payload_arenas) {
+        unsigned long long carved = 0, reused = 0;
+        size_t bytes = 0;
+        for (int i = 0; i < payload_arena_count; i++) {
+            carved += payload_arenas[i].carved;
+            reused += payload_arenas[i].reused;
+            bytes += payload_arenas[i].used;
         }
-        // Simulate time taken to consume
-        sleep(1);
+        printf("Payload arenas: %llu blocks carved (%zu KB), %llu reused\n", carved, bytes / 1024, reused);
+    }
+    printf("Wait statistics (parks / unparks / spurious wakeups / spin hits):\n");
+    if (shard_count == 1) {
+        print_wait_statistics("Suppliers waiting for space", &warehouse->empty);
+        print_wait_statistics("Retailers waiting for stock", &warehouse->full);
+    }
+    for (int s = 0; shard_count > 1 && s < shard_count; s++) {
+        char name[64];
+        snprintf(name, sizeof(name), "Shard %d suppliers waiting for space", s);
+        print_wait_statistics(name, &shard_state[s]->empty);
+        snprintf(name, sizeof(name), "Shard %d retailers waiting for stock", s);
+        print_wait_statistics(name, &shard_state[s]->full);
+    }
+    instr_report();
 
-        // Extract product from buffer
-        int item = extract_product();
-        
+    // close_log_file has already joined the logger, so nothing is left to wait for
+    printf("Exiting program...\n");
+    printf("Goodbye!\n");
+    fflush(stdout);
+}
 
-        snprintf(last_action, sizeof(last_action), "Retailer %d consumed item -> [%d]", id, item);
-        if (simulation_running) {
-            refresh_screen();
-        }
+void print_wait_statistics(const char* name, struct fsem* s) {
+    printf("  %s: %llu / %llu / %llu / %llu\n", name,
+           (unsigned long long)atomic_load(&s->parks), (unsigned long long)atomic_load(&s->unparks),
+           (unsigned long long)atomic_load(&s->spurious), (unsigned long long)atomic_load(&s->spin_hits));
+}
 
-        log_event_file("Consumed", id, item, "");
+// Signal handler for Ctrl+C and SIGTERM. Only async-signal-safe calls: the
+// coordinator on the main thread does the actual shutdown. A third signal
+// means the shutdown itself is stuck, so leave at once.
+void sigint_handler(int sig) {
+    int saved_errno = errno;
+    last_signal = sig;
+    signals_caught = signals_caught + 1;
+    if (signals_caught >= 3) {
+        static const char message[] = "\nForced exit.\n";
+        ssize_t ignored = write(STDERR_FILENO, message, sizeof(message) - 1);
+        (void)ignored;
+        _exit(128 + sig);
+    }
+    notify_coordinator();
+    errno = saved_errno;
+}
 
-        if (item == -1) {
-            pthread_mutex_unlock(&mutex);
-            sem_post(&full);
-            continue; // No items to consume
-        }
+void install_signal_handlers() {
+    shutdown_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (shutdown_fd < 0) {
+        printf("[ERROR] Could not create the shutdown eventfd: %s\n", strerror(errno));
+        exit(1);
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigint_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGINT, &sa, NULL) != 0 || sigaction(SIGTERM, &sa, NULL) != 0) {
+        printf("Error setting up signal handler for SIGINT\n");
+        exit(1);
+    }
+}
 
-        update_statistics(0, 1);
+// Wake the coordinator; async-signal-safe
+void notify_coordinator() {
+    uint64_t one = 1;
+    ssize_t ignored = write(shutdown_fd, &one, sizeof(one));
+    (void)ignored;
+}
 
-        pthread_mutex_unlock(&mutex);
-        sem_post(&empty);
-        
-        sleep(3);
+// Move to a later phase (never back), cut every sleep_ms short and, when
+// stopping, wake the threads blocked on credits so they can see it
+void begin_shutdown(int phase) {
+    int current = atomic_load(&shutdown_phase);
+    while (current < phase && !atomic_compare_exchange_weak(&shutdown_phase, &current, phase));
+    futex(&shutdown_phase, FUTEX_WAKE_PRIVATE, INT_MAX);
+    scale_release();
+    if (task_workers) task_flush(phase);
+    if (phase == SHUTDOWN_STOP) {
+        simulation_running = 0;
+        if (shm) {
+            // Other processes keep going, so leave the shared count and credits
+            // alone; this process's waiters time out and see the phase
+            return;
+        }
+        atomic_store(&warehouse->simulation_count, 0);
+        atomic_store(&warehouse->supply_count, 0);
+        for (int s = 0; s < shard_count; s++) {
+            fsem_post_n(&shard_state[s]->empty, NUM_PRODUCERS);
+            fsem_post_n(&shard_state[s]->full, NUM_CONSUMERS);
+        }
     }
-    return NULL;
 }
 
-// Add product to buffer
-void add_product(int item, int priority) {
-    if ((in + 1) % BUFFER_SIZE == out) {
-        log_error("Buffer overflow");
-        return;
+// Runs on the main thread while the workers do. Returns once every worker has
+// been joined: after the count was consumed, or after a signal and then the
+// drain (or straight away with --on-signal=abort). A second signal during the
+// drain aborts it.
+void coordinate_shutdown(pthread_t* prod_threads, pthread_t* cons_threads) {
+    int handled = 0, timed_out = 0;
+    uint64_t drain_start = 0;
+    uint64_t consumed_at_signal = 0;
+
+    while (atomic_load(&retailers_left) > 0 || (NUM_CONSUMERS == 0 && atomic_load(&suppliers_left) > 0)) {
+        int phase = atomic_load(&shutdown_phase);
+        struct pollfd wake = {.fd = shutdown_fd, .events = POLLIN};
+        poll(&wake, 1, phase == SHUTDOWN_DRAIN ? 10 : shm ? 200 : -1);
+        uint64_t value;
+        ssize_t ignored = read(shutdown_fd, &value, sizeof(value));
+        (void)ignored;
+
+        if (shm) {
+            shm_reap();
+            // A suppliers-only process is done once the shared count is used up
+            if (NUM_CONSUMERS == 0 && atomic_load(&warehouse->simulation_count) <= 0) break;
+        }
+
+        int caught = signals_caught;
+        if (caught > handled) {
+            handled = caught;
+            if (phase != SHUTDOWN_NONE || on_signal == ON_SIGNAL_ABORT) break;
+            consumed_at_signal = stats_total(retailer_stats, NUM_CONSUMERS, 1);
+            drain_start = now_ns();
+            begin_shutdown(SHUTDOWN_DRAIN);
+            if (!ui_enabled) {
+                printf("\nCaught signal %d, draining the warehouse (Ctrl+C again to abort)...\n", (int)last_signal);
+                fflush(stdout);
+            }
+            continue;
+        }
+        if (phase == SHUTDOWN_DRAIN) {
+            // Done once no supplier can still add anything and the shelves are empty
+            if (atomic_load(&suppliers_left) == 0 &&
+                (NUM_CONSUMERS == 0 || (stock_total() == 0 && atomic_load(&spill_pending) == 0)))
+                break;
+            if (now_ns() - drain_start >= (uint64_t)drain_timeout * 1000000000ULL) {
+                timed_out = 1;
+                break;
+            }
+        }
+    }
+    int drained = atomic_load(&shutdown_phase) == SHUTDOWN_DRAIN;
+    begin_shutdown(SHUTDOWN_STOP);
+
+    if (task_workers) {
+        stop_tasks();
+    } else {
+        for (int i = 0; i < NUM_PRODUCERS; i++)
+            pthread_join(prod_threads[i], NULL);
+        for (int i = 0; i < NUM_CONSUMERS; i++)
+            pthread_join(cons_threads[i], NULL);
     }
 
-    if (priority) {
-        urgent_buffer[urgent_in] = item;
-        urgent_in = (urgent_in + 1) % BUFFER_SIZE;
-        urgent_count++;
+    if (!handled) return;
+    int left = stock_total();
+    if (drained) {
+        unsigned long long taken = stats_total(retailer_stats, NUM_CONSUMERS, 1) - consumed_at_signal;
+        double seconds = (now_ns() - drain_start) / 1e9;
+        if (timed_out)
+            snprintf(shutdown_report, sizeof(shutdown_report),
+                     "Caught signal %d: drain timed out after %.1f s (%llu drained, %d items left)",
+                     (int)last_signal, seconds, taken, left);
+        else
+            snprintf(shutdown_report, sizeof(shutdown_report), "Caught signal %d: drained %llu items in %.1f s",
+                     (int)last_signal, taken, seconds);
     } else {
-        buffer[in] = item;
-        in = (in + 1) % BUFFER_SIZE;
+        snprintf(shutdown_report, sizeof(shutdown_report), "Caught signal %d: aborted with %d items left",
+                 (int)last_signal, left);
     }
 }
 
-// Extract product from buffer
-int extract_product() {
-    if (in == out && urgent_count == 0) {
-        log_error("Buffer underflow");
-        return -1;
+void log_error(const char* error) {
+    printf("[ERROR] %s\n", error);
+}
+
+void init_statistics() {
+    free(supplier_stats);
+    free(retailer_stats);
+    // A --role process has no threads on one side; keep one (unused) shard
+    // there. aligned_alloc wants a multiple of the alignment, which packed
+    // shards (WAREHOUSE_PACKED) are not.
+    size_t supplier_bytes = (NUM_PRODUCERS > 0 ? NUM_PRODUCERS : 1) * sizeof(struct thread_stats);
+    size_t retailer_bytes = (NUM_CONSUMERS > 0 ? NUM_CONSUMERS : 1) * sizeof(struct thread_stats);
+    supplier_bytes = (supplier_bytes + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    retailer_bytes = (retailer_bytes + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    supplier_stats = aligned_alloc(CACHE_LINE, supplier_bytes);
+    retailer_stats = aligned_alloc(CACHE_LINE, retailer_bytes);
+    if (!supplier_stats || !retailer_stats) {
+        printf("[ERROR] Could not allocate statistics!\n");
+        exit(1);
     }
+    memset(supplier_stats, 0, supplier_bytes);
+    memset(retailer_stats, 0, retailer_bytes);
+}
 
-    int item;
-    if (urgent_count > 0) {
-        item = urgent_buffer[urgent_out];
-        urgent_out = (urgent_out + 1) % BUFFER_SIZE;
-        urgent_count--;
-    } else {
-        item = buffer[out];
-        out = (out + 1) % BUFFER_SIZE;
+// Single writer per shard, so a plain load + store is enough (no locked add)
+void update_statistics(struct thread_stats* shard, int produced, int consumed) {
+    if (produced)
+        atomic_store_explicit(&shard->produced,
+                              atomic_load_explicit(&shard->produced, memory_order_relaxed) + produced,
+                              memory_order_relaxed);
+    if (consumed)
+        atomic_store_explicit(&shard->consumed,
+                              atomic_load_explicit(&shard->consumed, memory_order_relaxed) + consumed,
+                              memory_order_relaxed);
+}
+
+uint64_t stats_total(struct thread_stats* shards, int count, int consumed_side) {
+    uint64_t total = 0;
+    if (!shards) return 0;
+    for (int i = 0; i < count; i++)
+        total += atomic_load_explicit(consumed_side ? &shards[i].consumed : &shards[i].produced,
+                                      memory_order_relaxed);
+    return total;
+}
+
+void stats_range(struct thread_stats* shards, int count, int consumed_side, uint64_t* min, uint64_t* max) {
+    *min = *max = 0;
+    if (!shards) return;
+    for (int i = 0; i < count; i++) {
+        uint64_t v = atomic_load_explicit(consumed_side ? &shards[i].consumed : &shards[i].produced,
+                                          memory_order_relaxed);
+        if (i == 0 || v < *min) *min = v;
+        if (i == 0 || v > *max) *max = v;
     }
-    return item;
 }
 
-// Main function
-int main() {
-    srand(time(NULL));
-    if (signal(SIGINT, sigint_handler) == SIG_ERR) {
-        printf("Error setting up signal handler for SIGINT\n");
-        return 1;
+void open_log_file() {
+    log_clock_offset_ns = clock_offset_ns();
+    if (log_format == LOG_FORMAT_BINARY) {
+        segment_open_next(0);
+        log_fd = segment.fd;
+    } else {
+        log_fd = open(log_path, O_WRONLY | O_APPEND | O_CREAT, 0644);
     }
-    open_log_file();
-    
+    if (log_fd < 0) {
+        printf("[ERROR] Could not open log file!\n");
+        exit(1);
+    }
+    atomic_store(&logger_stop, 0);
+    pthread_create(&logger_thread, NULL, logger_main, NULL);
+}
+
+// Stops the logger thread after it has written and synced every queued event
+void close_log_file() {
+    if (log_fd < 0) return;
+    atomic_store(&logger_stop, 1);
+    pthread_join(logger_thread, NULL);
+    if (log_format == LOG_FORMAT_BINARY)
+        segment_close();
+    else
+        close(log_fd);
+    log_fd = -1;
+}
 
-    printf("Welcome to the Warehouse Simulation!\n");
-    sleep(2);
-    printf("This simulation will run until you press Ctrl+C or your simulation counter is ended.\n");
-    sleep(1);
+int64_t clock_offset_ns() {
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    return (int64_t)wall.tv_sec * 1000000000LL + wall.tv_nsec - (int64_t)now_ns();
+}
 
-    printf("Enter number of suppliers: ");
-    while (scanf("%d", &NUM_PRODUCERS) != 1 || NUM_PRODUCERS <= 0) {
-        printf("Invalid input. Enter a positive integer for number of suppliers: ");
-        while (getchar() != '\n'); // clear input buffer
+// Start the first unused warehouse.log.NNNNNN.bin segment numbered first_seq or later
+void segment_open_next(unsigned first_seq) {
+    char path[4096];
+    int fd = -1;
+    for (unsigned seq = first_seq; seq < 1000000; seq++) {
+        snprintf(path, sizeof(path), "%s.%06u.bin", log_path, seq);
+        fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd >= 0 || errno != EEXIST) {
+            segment.seq = seq;
+            break;
+        }
     }
-
-    printf("Enter number of retailers: ");
-    while (scanf("%d", &NUM_CONSUMERS) != 1 || NUM_CONSUMERS <= 0) {
-        printf("Invalid input. Enter a positive integer for number of retailers: ");
-        while (getchar() != '\n'); // clear input buffer
+    if (fd < 0 || ftruncate(fd, (off_t)segment_bytes) != 0) {
+        printf("[ERROR] Could not create event segment %s!\n", path);
+        exit(1);
     }
 
-    printf("Enter number of items to be consumed (to bound the simulation): ");
-    while (scanf("%d", &simulation_count) != 1 || simulation_count <= 0) {
-        printf("Invalid input. Enter a positive integer for number of items: ");
-        while (getchar() != '\n'); // clear input buffer
+    void* mem = mmap(NULL, segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        printf("[ERROR] Could not map event segment %s!\n", path);
+        exit(1);
     }
+    segment.fd = fd;
+    segment.bytes = segment_bytes;
+    segment.header = mem;
+    segment.records = (struct log_record*)(segment.header + 1);
+    segment.capacity = (segment_bytes - sizeof(struct segment_header)) / sizeof(struct log_record);
+    segment.synced = 0;
+
+    memcpy(segment.header->magic, SEGMENT_MAGIC, sizeof(segment.header->magic));
+    segment.header->version = SEGMENT_VERSION;
+    segment.header->record_size = sizeof(struct log_record);
+    segment.header->clock_offset_ns = log_clock_offset_ns;
+    atomic_store(&segment.header->record_count, 0);
+}
 
-    initscr();      // Start ncurses mode
-    cbreak();       // Disable line buffering
-    noecho();       // Don't echo input
-    curs_set(FALSE);// Hide the cursor
+// Sync what was written and shrink the file to the records it really holds
+void segment_close() {
+    if (segment.fd < 0) return;
+    size_t used = sizeof(struct segment_header) +
+                  atomic_load(&segment.header->record_count) * sizeof(struct log_record);
+    msync(segment.header, segment.bytes, MS_SYNC);
+    munmap(segment.header, segment.bytes);
+    if (ftruncate(segment.fd, (off_t)used) != 0)
+        log_error("Could not trim event segment");
+    fsync(segment.fd);
+    close(segment.fd);
+    segment.fd = -1;
+}
 
-    sem_init(&empty, 0, BUFFER_SIZE);
-    sem_init(&full, 0, 0);
-    pthread_mutex_init(&mutex, NULL);
+void segment_append(const struct log_record* records, size_t count) {
+    while (count > 0) {
+        size_t used = atomic_load_explicit(&segment.header->record_count, memory_order_relaxed);
+        if (used == segment.capacity) {
+            segment_close();
+            segment_open_next(segment.seq + 1);
+            log_fd = segment.fd;
+            continue;
+        }
+        size_t n = segment.capacity - used < count ? segment.capacity - used : count;
+        memcpy(&segment.records[used], records, n * sizeof(struct log_record));
+        atomic_store_explicit(&segment.header->record_count, used + n, memory_order_release);
+        records += n;
+        count -= n;
+    }
+}
 
-    pthread_t prod_threads[NUM_PRODUCERS], cons_threads[NUM_CONSUMERS];
-    
-    for (int i = 0; i < NUM_PRODUCERS; i++)
-        pthread_create(&prod_threads[i], NULL, supplier, (void*)(long)(i+1));
+// Render one record as a warehouse.log line or CSV row; returns its length
+size_t format_log_record(char* out, size_t size, const struct log_record* r, int64_t offset_ns, int format) {
+    static __thread time_t cached_sec = -1;
+    static __thread char stamp[32];
 
-    for (int i = 0; i < NUM_CONSUMERS; i++)
-        pthread_create(&cons_threads[i], NULL, retailer, (void*)(long)(i+1));
+    uint64_t wall_ns = (uint64_t)((int64_t)r->mono_ns + offset_ns);
+    const char* event = r->event == EVENT_PRODUCED ? "Produced" : "Consumed";
+    char type[24] = "";
+    if (r->priority == 1)
+        snprintf(type, sizeof(type), "(PRIORITY)");
+    else if (r->priority > 1)
+        snprintf(type, sizeof(type), "(PRIORITY %d)", r->priority);
+    int len;
 
-    for (int i = 0; i < NUM_PRODUCERS; i++)
-        pthread_join(prod_threads[i], NULL);
+    if (format == LOG_FORMAT_CSV) {
+        len = snprintf(out, size, "%llu,%llu,%d,%s,%d,%d,%u\n",
+                       (unsigned long long)r->mono_ns, (unsigned long long)wall_ns,
+                       r->thread_id, r->event == EVENT_PRODUCED ? "produced" : "consumed",
+                       r->item, r->priority, r->depth);
+        return len > 0 ? (size_t)len : 0;
+    }
 
-    for (int i = 0; i < NUM_CONSUMERS; i++)
-        pthread_join(cons_threads[i], NULL);
+    time_t sec = (time_t)(wall_ns / 1000000000ULL);
+    if (sec != cached_sec) {
+        struct tm t;
+        localtime_r(&sec, &t);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &t);
+        cached_sec = sec;
+    }
+    if (format == LOG_FORMAT_PRECISE)
+        len = snprintf(out, size, "[%s.%06llu] [LOG] %s: Thread %d %s item %d\n",
+                       stamp, (unsigned long long)(wall_ns % 1000000000ULL / 1000),
+                       event, r->thread_id, type, r->item);
+    else
+        len = snprintf(out, size, "[%s] [LOG] %s: Thread %d %s item %d\n",
+                       stamp, event, r->thread_id, type, r->item);
+    return len > 0 ? (size_t)len : 0;
+}
+
+// Companion reader for binary segments: prints every record to stdout
+int read_event_file(const char* path, int format) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct segment_header)) {
+        printf("[ERROR] Could not read event segment %s\n", path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    void* mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        printf("[ERROR] Could not map event segment %s\n", path);
+        return -1;
+    }
+    madvise(mem, st.st_size, MADV_SEQUENTIAL);
+
+    const struct segment_header* header = mem;
+    if (memcmp(header->magic, SEGMENT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != SEGMENT_VERSION || header->record_size != sizeof(struct log_record)) {
+        printf("[ERROR] %s is not a warehouse event segment\n", path);
+        munmap(mem, st.st_size);
+        return -1;
+    }
+    uint64_t count = atomic_load(&((struct segment_header*)mem)->record_count);
+    uint64_t fits = (st.st_size - sizeof(struct segment_header)) / sizeof(struct log_record);
+    if (count > fits) count = fits;
+
+    const struct log_record* records = (const struct log_record*)(header + 1);
+    char line[256];
+    for (uint64_t i = 0; i < count; i++) {
+        size_t len = format_log_record(line, sizeof(line), &records[i], header->clock_offset_ns, format);
+        fwrite(line, 1, len, stdout);
+    }
+    munmap(mem, st.st_size);
+    return 0;
+}
+
+struct log_buffer* log_buffer_register() {
+    struct log_buffer* b = calloc(1, sizeof(struct log_buffer));
+    if (!b) {
+        printf("[ERROR] Could not allocate log buffer!\n");
+        exit(1);
+    }
+    b->next = atomic_load(&log_buffers);
+    while (!atomic_compare_exchange_weak(&log_buffers, &b->next, b))
+        ;
+    my_log_buffer = b;
+    return b;
+}
+
+// Queue an event for the logger thread; never touches the file itself
+void log_event(int event, int id, int item, int priority, int depth) {
+    if (log_fd < 0) return;
+
+    struct log_buffer* b = my_log_buffer ? my_log_buffer : log_buffer_register();
+    size_t tail = atomic_load_explicit(&b->tail, memory_order_relaxed);
+    while (tail - atomic_load_explicit(&b->head, memory_order_acquire) >= LOG_RING_SIZE)
+        sched_yield(); // logger is behind; wait for it rather than lose the event
+
+    struct log_record* r = &b->records[tail & (LOG_RING_SIZE - 1)];
+    r->mono_ns = now_ns();
+    r->thread_id = id;
+    r->item = item;
+    r->depth = (uint32_t)depth;
+    r->event = (uint8_t)event;
+    r->priority = (uint8_t)priority;
+    r->reserved = 0;
+    atomic_store_explicit(&b->tail, tail + 1, memory_order_release);
+}
+
+static int log_record_cmp(const void* a, const void* b) {
+    uint64_t x = ((const struct log_record*)a)->mono_ns;
+    uint64_t y = ((const struct log_record*)b)->mono_ns;
+    return (x > y) - (x < y);
+}
+
+static void logger_write(const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(log_fd, data, len);
+        if (n < 0) {
+            log_error("Could not write log file");
+            return;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+// Collect a batch from every thread buffer, order it by time and write it out
+// with as few write() calls as possible. Returns the number of events written.
+size_t logger_drain(struct log_record* batch, char* out, size_t* pending) {
+    size_t count = 0;
+    for (struct log_buffer* b = atomic_load(&log_buffers); b && count < LOG_BATCH_EVENTS; b = b->next) {
+        size_t head = atomic_load_explicit(&b->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&b->tail, memory_order_acquire);
+        while (head != tail && count < LOG_BATCH_EVENTS)
+            batch[count++] = b->records[head++ & (LOG_RING_SIZE - 1)];
+        atomic_store_explicit(&b->head, head, memory_order_release);
+    }
+    if (count == 0) return 0;
+    qsort(batch, count, sizeof(struct log_record), log_record_cmp);
+
+    if (log_format == LOG_FORMAT_BINARY) {
+        segment_append(batch, count);
+        *pending += count * sizeof(struct log_record);
+        return count;
+    }
+
+    size_t used = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (used + 256 > LOG_WRITE_BUFFER) {
+            logger_write(out, used);
+            *pending += used;
+            used = 0;
+        }
+        used += format_log_record(out + used, LOG_WRITE_BUFFER - used, &batch[i], log_clock_offset_ns, log_format);
+    }
+    logger_write(out, used);
+    *pending += used;
+    return count;
+}
+
+void* logger_main(void* arg) {
+    (void)arg;
+    struct log_record* batch = malloc(LOG_BATCH_EVENTS * sizeof(struct log_record));
+    char* out = malloc(LOG_WRITE_BUFFER);
+    if (!batch || !out) {
+        log_error("Could not allocate logger buffers");
+        exit(1);
+    }
+
+    size_t pending = 0;          // bytes written since the last fsync
+    uint64_t last_sync = now_ns();
+    for (;;) {
+        int stopping = atomic_load(&logger_stop);
+        size_t n = logger_drain(batch, out, &pending);
+
+        uint64_t now = now_ns();
+        if (pending > 0 && (stopping || (long)pending >= log_fsync_bytes ||
+                            now - last_sync >= (uint64_t)log_fsync_ms * 1000000ULL)) {
+            if (log_format == LOG_FORMAT_BINARY) {
+                // Only the pages holding records appended since the last sync
+                size_t used = atomic_load(&segment.header->record_count);
+                uintptr_t from = (uintptr_t)&segment.records[segment.synced] & ~(uintptr_t)4095;
+                msync((void*)from, (uintptr_t)&segment.records[used] - from, MS_SYNC);
+                segment.synced = used;
+            } else {
+                fsync(log_fd);
+            }
+            pending = 0;
+            last_sync = now;
+        }
+        if (stopping && n == 0) break;
+        if (n == 0) {
+            struct timespec idle = {0, LOG_IDLE_SLEEP_MS * 1000000L};
+            nanosleep(&idle, NULL);
+        }
+    }
+    free(batch);
+    free(out);
+    return NULL;
+}
+
+void pcg32_seed(struct pcg32* rng, uint64_t seed, uint64_t stream) {
+    rng->state = 0;
+    rng->inc = (stream << 1) | 1;
+    pcg32_next(rng);
+    rng->state += seed;
+    pcg32_next(rng);
+}
+
+// PCG-XSH-RR: 64-bit LCG state, 32-bit permuted output
+uint32_t pcg32_next(struct pcg32* rng) {
+    uint64_t old = rng->state;
+    rng->state = old * 6364136223846793005ULL + rng->inc;
+    uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+    uint32_t rot = (uint32_t)(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+// Uniform in [0, bound) without modulo bias (Lemire's multiply-shift)
+uint32_t pcg32_bounded(struct pcg32* rng, uint32_t bound) {
+    uint64_t m = (uint64_t)pcg32_next(rng) * bound;
+    if ((uint32_t)m < bound) {
+        uint32_t threshold = -bound % bound;
+        while ((uint32_t)m < threshold) m = (uint64_t)pcg32_next(rng) * bound;
+    }
+    return (uint32_t)(m >> 32);
+}
+
+// Uniform in [0, 1)
+double pcg32_unit(struct pcg32* rng) {
+    return pcg32_next(rng) * (1.0 / 4294967296.0);
+}
+
+// Natural log and exp for the generators; the build does not link libm.
+// ln splits off the binary exponent and runs an atanh series on [0.7, 1.4].
+static double ln_approx(double x) {
+    union { double d; uint64_t u; } v = {x};
+    int e = (int)((v.u >> 52) & 0x7FF) - 1023;
+    v.u = (v.u & 0x000FFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL;
+    double m = v.d;
+    if (m > 1.4142135623730951) {
+        m *= 0.5;
+        e++;
+    }
+    double t = (m - 1) / (m + 1), t2 = t * t;
+    double series = t * (2 + t2 * (2.0 / 3 + t2 * (2.0 / 5 + t2 * (2.0 / 7 + t2 * (2.0 / 9 + t2 * (2.0 / 11))))));
+    return e * 0.6931471805599453 + series;
+}
+
+static double exp_approx(double x) {
+    if (x < -700) return 0;
+    if (x > 700) x = 700;
+    int k = (int)(x / 0.6931471805599453 + (x < 0 ? -0.5 : 0.5));
+    double r = x - k * 0.6931471805599453, term = 1, sum = 1;
+    for (int i = 1; i <= 12; i++) {
+        term *= r / i;
+        sum += term;
+    }
+    union { double d; uint64_t u; } scale = {.u = (uint64_t)(k + 1023) << 52};
+    return sum * scale.d;
+}
+
+// Cumulative Zipf weights 1/k^s for k = 1..n
+static void zipf_cdf(double* cdf, int n) {
+    double total = 0;
+    for (int k = 1; k <= n; k++) {
+        total += exp_approx(-zipf_s * ln_approx(k));
+        cdf[k - 1] = total;
+    }
+    for (int k = 0; k < n; k++) cdf[k] /= total;
+}
+
+static int zipf_draw(struct pcg32* rng, const double* cdf, int n) {
+    double u = pcg32_unit(rng);
+    int lo = 0, hi = n - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cdf[mid] > u) hi = mid;
+        else lo = mid + 1;
+    }
+    return lo;
+}
+
+// Build the shared tables once the options are known
+void workload_init() {
+    if (!seed_given) workload_seed = now_ns() ^ ((uint64_t)getpid() << 32);
+    if (burst_ms <= 0) burst_ms = 5 * arrival_ms;
+    if (item_dist == DIST_ZIPF && !item_zipf_cdf) {
+        item_zipf_cdf = malloc(item_range * sizeof(double));
+        if (!item_zipf_cdf) {
+            printf("[ERROR] Could not allocate the Zipf table!\n");
+            exit(1);
+        }
+        zipf_cdf(item_zipf_cdf, item_range);
+    }
+    if (priority_dist == DIST_ZIPF) zipf_cdf(priority_zipf_cdf, priority_levels);
+}
+
+static double exponential(struct pcg32* rng, double mean) {
+    return -mean * ln_approx(1.0 - pcg32_unit(rng));
+}
+
+// Milliseconds until the calling supplier's next batch
+double next_arrival_ms(struct pcg32* rng) {
+    switch (arrival_dist) {
+    case ARRIVAL_UNIFORM:
+        return pcg32_unit(rng) * 2.0 * arrival_ms;
+    case ARRIVAL_POISSON:
+        return exponential(rng, arrival_ms);
+    case ARRIVAL_BURSTY: {
+        // On phases average burst_ms, off phases three times that, so the
+        // long-run rate still matches arrival_ms
+        double gap = 0;
+        for (;;) {
+            if (burst_on) {
+                double next = exponential(rng, arrival_ms / 4.0);
+                if (next <= burst_left_ms) {
+                    burst_left_ms -= next;
+                    return gap + next;
+                }
+                gap += burst_left_ms;
+                burst_on = 0;
+                burst_left_ms = exponential(rng, 3.0 * burst_ms);
+            } else {
+                gap += burst_left_ms;
+                burst_on = 1;
+                burst_left_ms = exponential(rng, burst_ms);
+            }
+        }
+    }
+    default:
+        return arrival_ms;
+    }
+}
+
+int next_item(struct pcg32* rng) {
+    if (item_dist == DIST_ZIPF) return zipf_draw(rng, item_zipf_cdf, item_range);
+    return (int)pcg32_bounded(rng, item_range);
+}
+
+int next_priority(struct pcg32* rng) {
+    if (priority_dist == DIST_ZIPF) return zipf_draw(rng, priority_zipf_cdf, priority_levels);
+    return (int)pcg32_bounded(rng, priority_levels);
+}
+
+// Simulated work time. It waits on shutdown_phase, so it ends early once a
+// shutdown begins and a drain is not held up by the simulated delays.
+void sleep_ms(double ms) {
+    if (ms <= 0) return;
+    uint64_t deadline = now_ns() + (uint64_t)(ms * 1e6);
+    while (atomic_load(&shutdown_phase) == SHUTDOWN_NONE) {
+        uint64_t now = now_ns();
+        if (now >= deadline) return;
+        struct timespec ts = {(time_t)((deadline - now) / 1000000000ULL), (long)((deadline - now) % 1000000000ULL)};
+        syscall(SYS_futex, &shutdown_phase, FUTEX_WAIT_PRIVATE, SHUTDOWN_NONE, &ts, NULL, 0);
+    }
+}
+
+// Reserve one arena per producer; the address space is only backed as used
+void payload_init(int arenas) {
+    if (arenas > MAX_ARENAS) {
+        printf("[ERROR] Payloads support at most %d producers\n", MAX_ARENAS);
+        exit(1);
+    }
+    payload_arenas = aligned_alloc(CACHE_LINE, arenas * sizeof(struct payload_arena));
+    if (!payload_arenas) {
+        printf("[ERROR] Could not allocate payload arenas!\n");
+        exit(1);
+    }
+    memset(payload_arenas, 0, arenas * sizeof(struct payload_arena));
+    for (int i = 0; i < arenas; i++) {
+        payload_arenas[i].base = mmap(NULL, 1UL << ARENA_SHIFT, PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (payload_arenas[i].base == MAP_FAILED) {
+            printf("[ERROR] Could not reserve a payload arena: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    payload_arena_count = arenas;
+    atomic_store(&payload_arena_next, 0);
+}
+
+void payload_destroy() {
+    for (int i = 0; i < payload_arena_count; i++)
+        munmap(payload_arenas[i].base, 1UL << ARENA_SHIFT);
+    free(payload_arenas);
+    payload_arenas = NULL;
+    payload_arena_count = 0;
+}
+
+// Record size of an item, spread over [payload_min, payload_max] by a hash of
+// the item so that every run (and both allocators) see the same sizes
+static int payload_length(int item) {
+    return payload_min + (int)(((uint32_t)item * 2654435761u) % (uint32_t)(payload_max - payload_min + 1));
+}
+
+// Owner side: a block of class cls, from the local list, else from what
+// consumers gave back, else freshly carved from the arena
+static struct payload_block* payload_alloc_block(struct payload_arena* a, int cls) {
+    struct payload_block* b = a->local[cls];
+    if (!b) b = atomic_exchange_explicit(&a->remote[cls], NULL, memory_order_acquire);
+    if (b) {
+        a->local[cls] = b->next;
+        a->reused++;
+        return b;
+    }
+    size_t size = (size_t)PAYLOAD_UNIT << cls;
+    if (a->used + size > (1UL << ARENA_SHIFT)) {
+        printf("[ERROR] Payload arena exhausted!\n");
+        exit(1);
+    }
+    b = (struct payload_block*)(a->base + a->used);
+    a->used += size;
+    a->carved++;
+    b->cls = cls;
+    return b;
+}
+
+// Build the record for item in this thread's arena and return its descriptor
+int payload_make(int item) {
+    if (my_arena < 0) my_arena = atomic_fetch_add(&payload_arena_next, 1);
+    if (my_arena >= payload_arena_count) {
+        printf("[ERROR] More payload producers than arenas!\n");
+        exit(1);
+    }
+    struct payload_arena* a = &payload_arenas[my_arena];
+    int length = payload_length(item);
+    size_t need = payload_alloc == PAYLOAD_MALLOC ? sizeof(struct payload_block)
+                                                  : sizeof(struct payload_block) + (size_t)length;
+    int cls = 0;
+    while (((size_t)PAYLOAD_UNIT << cls) < need) cls++;
+
+    struct payload_block* b = payload_alloc_block(a, cls);
+    b->item = (uint32_t)item;
+    b->length = (uint32_t)length;
+    char* data = b->data;
+    if (payload_alloc == PAYLOAD_MALLOC) {
+        b->heap = malloc(length);
+        if (!b->heap) {
+            printf("[ERROR] Could not allocate a payload!\n");
+            exit(1);
+        }
+        data = b->heap;
+    }
+    memset(data, item & 0xFF, length);
+    return (my_arena << ARENA_BLOCK_BITS) | (int)(((char*)b - a->base) / PAYLOAD_UNIT);
+}
+
+// Consumer side: check the record, hand its block back to the owning arena
+// and return the item it carried
+int payload_consume(int descriptor) {
+    struct payload_arena* a = &payload_arenas[descriptor >> ARENA_BLOCK_BITS];
+    struct payload_block* b =
+        (struct payload_block*)(a->base + (size_t)(descriptor & ((1 << ARENA_BLOCK_BITS) - 1)) * PAYLOAD_UNIT);
+    const char* data = payload_alloc == PAYLOAD_MALLOC ? b->heap : b->data;
+    char fill = (char)(b->item & 0xFF);
+    if (data[0] != fill || data[b->length - 1] != fill) {
+        printf("[ERROR] Payload of item %u is corrupted!\n", b->item);
+        exit(1);
+    }
+    int item = (int)b->item;
+    if (payload_alloc == PAYLOAD_MALLOC) free(b->heap);
+
+    _Atomic(struct payload_block*)* head = &a->remote[b->cls];
+    struct payload_block* next = atomic_load_explicit(head, memory_order_relaxed);
+    do {
+        b->next = next;
+    } while (!atomic_compare_exchange_weak_explicit(head, &next, b, memory_order_release, memory_order_relaxed));
+    return item;
+}
+
+// The item a descriptor carries, leaving the record in place (for snapshots)
+int payload_item(int descriptor) {
+    struct payload_arena* a = &payload_arenas[descriptor >> ARENA_BLOCK_BITS];
+    struct payload_block* b =
+        (struct payload_block*)(a->base + (size_t)(descriptor & ((1 << ARENA_BLOCK_BITS) - 1)) * PAYLOAD_UNIT);
+    return (int)b->item;
+}
+
+// Reserve up to want tickets: the fetch_sub is the claim, and whatever it
+// took beyond what was left goes straight back. Returns the number reserved,
+// 0 once the tickets are used up. In shared-memory mode the claim is recorded
+// in held under the mutex, in the same step, so shm_reap can return it.
+int claim_tickets(atomic_int* tickets, int want, int* held) {
+    if (held) lock_warehouse();
+    int left = atomic_fetch_sub_explicit(tickets, want, memory_order_relaxed);
+    int got = left >= want ? want : left > 0 ? left : 0;
+    if (got < want) atomic_fetch_add_explicit(tickets, want - got, memory_order_relaxed);
+    if (held) {
+        *held += got;
+        unlock_warehouse();
+    }
+    return got;
+}
+
+// Give back reserved tickets that were not used (stop or drain)
+void return_tickets(atomic_int* tickets, int count, int* held) {
+    if (held) lock_warehouse();
+    atomic_fetch_add_explicit(tickets, count, memory_order_relaxed);
+    if (held) {
+        *held -= count;
+        unlock_warehouse();
+    }
+}
+
+// Producer thread function
+void* supplier(void* arg) {
+    int id = (long)arg;
+    struct thread_stats* stats = &supplier_stats[id - 1];
+    pcg32_seed(&my_rng, workload_seed, id);
+    trace_attach("Supplier", id);
+    int* held = shm_me ? &shm_me->supplying : NULL;
+    while (atomic_load(&shutdown_phase) == SHUTDOWN_NONE) {
+        scale_park(&active_suppliers, id, &warehouse->supply_count);
+        int batch = claim_tickets(&warehouse->supply_count, supplier_batch, held);
+        if (batch == 0) {
+            scale_release(); // parked suppliers find no tickets either
+            // Another supplier process may still die and hand its tickets back
+            if (!shm || atomic_load(&warehouse->simulation_count) <= 0) break;
+            sleep_ms(100);
+            continue;
+        }
+
+        int items[MAX_BATCH], priorities[MAX_BATCH], counts[MAX_SHARDS];
+        for (int i = 0; i < batch; i++) {
+            items[i] = next_item(&my_rng);
+            priorities[i] = next_priority(&my_rng);
+        }
+        if (shard_count > 1) route_batch(items, priorities, batch, counts);
+        uint64_t trace_start = trace_begin(TRACE_PRODUCE);
+        sleep_ms(next_arrival_ms(&my_rng)); // Simulate time taken to produce
+        trace_end(TRACE_PRODUCE, trace_start, batch);
+        if (atomic_load(&shutdown_phase) != SHUTDOWN_NONE) {
+            return_tickets(&warehouse->supply_count, batch, held); // the batch was never produced
+            break;
+        }
+
+        int depth = 0;
+        int stored;
+        trace_start = trace_begin(TRACE_PUT);
+        if (payload_max) {
+            int descriptors[MAX_BATCH];
+            for (int i = 0; i < batch; i++) descriptors[i] = payload_make(items[i]);
+            stored = shard_admit(descriptors, priorities, batch, counts, &depth);
+            // A stop cut the batch short; the rest never went out
+            for (int i = stored; i < batch; i++) payload_consume(descriptors[i]);
+        } else {
+            stored = shard_admit(items, priorities, batch, counts, &depth);
+        }
+        trace_end(TRACE_PUT, trace_start, stored);
+        if (stored < batch) return_tickets(&warehouse->supply_count, batch - stored, held);
+        if (stored == 0) {
+            if (atomic_load(&shutdown_phase) == SHUTDOWN_STOP) break;
+            continue; // all dropped by the overflow policy
+        }
+        for (int i = 0; i < stored; i++)
+            log_event(EVENT_PRODUCED, id, items[i], priorities[i], depth);
+        int last = stored - 1;
+        atomic_store_explicit(&last_action, PACK_ACTION(ACTION_PRODUCED, id, items[last], priorities[last]),
+                              memory_order_relaxed);
+        update_statistics(stats, stored, 0);
+    }
+    atomic_fetch_sub(&suppliers_left, 1);
+    return NULL;
+}
+
+// Consumer thread function
+void* retailer(void* arg) {
+    int id = (long)arg;
+    struct thread_stats* stats = &retailer_stats[id - 1];
+    home_shard = (id - 1) % shard_count;
+    steal_attach();
+    trace_attach("Retailer", id);
+    // Tickets reserved but not consumed yet; a retailer keeps taking until it
+    // has used all it reserved, so none is handed back before a stop
+    int owed = 0;
+    int* held = shm_me ? &shm_me->claimed : NULL; // handed back by shm_reap if this process dies
+    while (atomic_load(&shutdown_phase) != SHUTDOWN_STOP) {
+        if (owed == 0) {
+            scale_park(&active_retailers, id, &warehouse->simulation_count);
+            if ((owed = claim_tickets(&warehouse->simulation_count, retailer_batch, held)) == 0) {
+                scale_release();
+                break;
+            }
+        }
+
+        // Extract up to owed products from buffer
+        int items[MAX_BATCH];
+        int depth;
+        uint64_t trace_start = trace_begin(TRACE_TAKE);
+        int taken = shard_count > 1 ? shard_take(items, owed, &depth) : take_products(items, owed, &depth);
+        trace_end(TRACE_TAKE, trace_start, taken > 0 ? taken : 0);
+        if (taken == -1) continue; // No items to consume
+        owed -= taken;
+        spill_refill(); // the slots just freed go to spilled items first
+        for (int i = 0; payload_max && i < taken; i++) items[i] = payload_consume(items[i]);
+
+        // Simulate time taken to consume
+        trace_start = trace_begin(TRACE_CONSUME);
+        sleep_ms(1000);
+        trace_end(TRACE_CONSUME, trace_start, taken);
+
+        for (int i = 0; i < taken; i++)
+            log_event(EVENT_CONSUMED, id, items[i], 0, depth);
+        atomic_store_explicit(&last_action, PACK_ACTION(ACTION_CONSUMED, id, items[taken - 1], 0),
+                              memory_order_relaxed);
+        update_statistics(stats, 0, taken);
+
+        sleep_ms(3000);
+    }
+    // shm_take_products already struck the consumed ones off the claim
+    if (owed) return_tickets(&warehouse->simulation_count, owed, held);
+    if (atomic_fetch_sub(&retailers_left, 1) == 1) notify_coordinator();
+    return NULL;
+}
+
+void task_list_push(struct task_list* l, struct task* t) {
+    t->next = NULL;
+    if (l->tail) l->tail->next = t;
+    else l->head = t;
+    l->tail = t;
+}
+
+// Append a chain of tasks to the run queue and wake workers for them
+void task_runnable(struct task_list* chain) {
+    if (!chain->head) return;
+    pthread_mutex_lock(&task_lock);
+    if (task_queue.tail) task_queue.tail->next = chain->head;
+    else task_queue.head = chain->head;
+    task_queue.tail = chain->tail;
+    pthread_cond_broadcast(&task_ready);
+    pthread_mutex_unlock(&task_lock);
+}
+
+// Stands in for sleep_ms: the task goes on the wheel, or straight back to
+// the run queue once a shutdown has begun
+void task_sleep(struct task* t) {
+    if (t->sleep_ms <= 0 || atomic_load(&shutdown_phase) != SHUTDOWN_NONE) {
+        struct task_list one = {t, t};
+        t->next = NULL;
+        task_runnable(&one);
+        return;
+    }
+    uint64_t ticks = (uint64_t)(t->sleep_ms * 1e6 / TASK_TICK_NS);
+    if (ticks == 0) ticks = 1;
+    pthread_mutex_lock(&wheel_lock);
+    t->rounds = (unsigned)((ticks - 1) / TASK_WHEEL_SLOTS);
+    task_list_push(&task_wheel[(wheel_tick + ticks) % TASK_WHEEL_SLOTS], t);
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+// Stands in for fsem_wait_upto. The count goes up before the credits are
+// looked at again and posters look at the count after adding credits, so
+// either this side sees the credit or the poster sees the waiter.
+void task_park(struct task* t) {
+    struct task_waiters* w = t->wait_on == &warehouse->empty ? &space_waiters : &stock_waiters;
+    pthread_mutex_lock(&w->lock);
+    atomic_fetch_add(&w->count, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (fsem_value(t->wait_on) > 0 || atomic_load(&shutdown_phase) == SHUTDOWN_STOP) {
+        atomic_fetch_sub(&w->count, 1);
+        pthread_mutex_unlock(&w->lock);
+        struct task_list one = {t, t};
+        t->next = NULL;
+        task_runnable(&one);
+        return;
+    }
+    task_list_push(&w->list, t);
+    pthread_mutex_unlock(&w->lock);
+    atomic_fetch_add_explicit(&task_waits, 1, memory_order_relaxed);
+}
+
+// n credits were posted to s: let up to n of its waiting tasks try again
+void task_wake(struct fsem* s, int n) {
+    struct task_waiters* w = s == &warehouse->empty ? &space_waiters : s == &warehouse->full ? &stock_waiters : NULL;
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!w || atomic_load(&w->count) == 0) return;
+    struct task_list chain = {NULL, NULL};
+    pthread_mutex_lock(&w->lock);
+    while (n-- > 0 && w->list.head) {
+        struct task* t = w->list.head;
+        w->list.head = t->next;
+        if (!w->list.head) w->list.tail = NULL;
+        atomic_fetch_sub(&w->count, 1);
+        task_list_push(&chain, t);
+    }
+    pthread_mutex_unlock(&w->lock);
+    task_runnable(&chain);
+}
+
+// A shutdown cuts every sleep short and, when stopping, ends every wait,
+// like the futex wake in begin_shutdown does for threads
+void task_flush(int phase) {
+    struct task_list chain = {NULL, NULL};
+    pthread_mutex_lock(&wheel_lock);
+    for (int i = 0; i < TASK_WHEEL_SLOTS; i++) {
+        while (task_wheel[i].head) {
+            struct task* t = task_wheel[i].head;
+            task_wheel[i].head = t->next;
+            task_list_push(&chain, t);
+        }
+        task_wheel[i].tail = NULL;
+    }
+    pthread_mutex_unlock(&wheel_lock);
+    for (int k = 0; phase == SHUTDOWN_STOP && k < 2; k++) {
+        struct task_waiters* w = k ? &stock_waiters : &space_waiters;
+        pthread_mutex_lock(&w->lock);
+        while (w->list.head) {
+            struct task* t = w->list.head;
+            w->list.head = t->next;
+            task_list_push(&chain, t);
+        }
+        w->list.tail = NULL;
+        atomic_store(&w->count, 0);
+        pthread_mutex_unlock(&w->lock);
+    }
+    task_runnable(&chain);
+}
+
+// One step of the supplier loop above, up to its next sleep or wait
+int supplier_step(struct task* t) {
+    int* items = t->items;
+    int* priorities = items + supplier_batch;
+    int* descriptors = priorities + supplier_batch;
+    switch (t->at) {
+    case TASK_AT_CLAIM:
+        if (atomic_load(&shutdown_phase) != SHUTDOWN_NONE) return TASK_DONE;
+        if ((t->batch = claim_tickets(&warehouse->supply_count, supplier_batch, NULL)) == 0) return TASK_DONE;
+        for (int i = 0; i < t->batch; i++) {
+            items[i] = next_item(&my_rng);
+            priorities[i] = next_priority(&my_rng);
+        }
+        t->sleep_ms = next_arrival_ms(&my_rng); // Simulate time taken to produce
+        t->at = TASK_AT_PRODUCED;
+        return TASK_SLEEP;
+    case TASK_AT_PRODUCED:
+        if (atomic_load(&shutdown_phase) != SHUTDOWN_NONE) {
+            return_tickets(&warehouse->supply_count, t->batch, NULL); // the batch was never produced
+            return TASK_DONE;
+        }
+        for (int i = 0; payload_max && i < t->batch; i++) descriptors[i] = payload_make(items[i]);
+        if (overflow_policy == OVERFLOW_BLOCK && fsem_value(&warehouse->empty) < t->batch)
+            atomic_fetch_add_explicit(&overflow.waited, 1, memory_order_relaxed);
+        t->stored = 0;
+        t->at = TASK_AT_PUT;
+        __attribute__((fallthrough));
+    case TASK_AT_PUT: {
+        int* out = payload_max ? descriptors : items;
+        if (overflow_policy != OVERFLOW_BLOCK && overflow_policy != OVERFLOW_DROP_OLDEST) {
+            t->stored = admit_products(out, priorities, t->batch, &t->depth); // never waits
+        } else {
+            // admit_products would block the worker in fsem_wait_upto, so the
+            // waits of both waiting policies are task waits here instead
+            while (t->stored < t->batch && atomic_load(&shutdown_phase) != SHUTDOWN_STOP) {
+                int seen = atomic_load(&snapshot_epoch);
+                int got = fsem_take(&warehouse->empty, t->batch - t->stored);
+                if (!got && overflow_policy == OVERFLOW_DROP_OLDEST && priorities[t->stored] > 0) {
+                    if (!overflow_enter(seen)) continue;
+                    int evicted = evict_normal_for(out[t->stored], priorities[t->stored]);
+                    overflow_leave();
+                    if (evicted) {
+                        atomic_fetch_add_explicit(&overflow.evicted, 1, memory_order_relaxed);
+                        return_tickets(&warehouse->supply_count, 1, NULL); // the evicted item is never consumed
+                        t->stored++;
+                        continue;
+                    }
+                }
+                if (!got) {
+                    if (overflow_policy == OVERFLOW_DROP_OLDEST)
+                        atomic_fetch_add_explicit(&overflow.waited, 1, memory_order_relaxed);
+                    t->wait_on = &warehouse->empty;
+                    return TASK_WAIT;
+                }
+                store_products(out + t->stored, priorities + t->stored, got, &t->depth);
+                t->stored += got;
+            }
+        }
+        int stored = t->stored;
+        for (int i = stored; payload_max && i < t->batch; i++) payload_consume(descriptors[i]);
+        if (stored < t->batch) return_tickets(&warehouse->supply_count, t->batch - stored, NULL);
+        t->at = TASK_AT_CLAIM;
+        if (stored == 0) {
+            if (atomic_load(&shutdown_phase) == SHUTDOWN_STOP) return TASK_DONE;
+            // All dropped: make the next batch once there is room for it again
+            t->wait_on = &warehouse->empty;
+            return TASK_WAIT;
+        }
+        for (int i = 0; i < stored; i++)
+            log_event(EVENT_PRODUCED, t->id, items[i], priorities[i], t->depth);
+        atomic_store_explicit(&last_action, PACK_ACTION(ACTION_PRODUCED, t->id, items[stored - 1],
+                                                        priorities[stored - 1]), memory_order_relaxed);
+        update_statistics(&supplier_stats[t->id - 1], stored, 0);
+        return TASK_RUN;
+    }
+    }
+    return TASK_DONE;
+}
+
+// One step of the retailer loop above, up to its next sleep or wait
+int retailer_step(struct task* t) {
+    int* items = t->items;
+    switch (t->at) {
+    case TASK_AT_CLAIM:
+        if (atomic_load(&shutdown_phase) == SHUTDOWN_STOP) return TASK_DONE;
+        if (t->owed == 0 && (t->owed = claim_tickets(&warehouse->simulation_count, retailer_batch, NULL)) == 0)
+            return TASK_DONE;
+        t->at = TASK_AT_TAKE;
+        __attribute__((fallthrough));
+    case TASK_AT_TAKE: {
+        if (atomic_load(&shutdown_phase) == SHUTDOWN_STOP) return TASK_DONE;
+        int got = fsem_take(&warehouse->full, t->owed);
+        if (!got) {
+            t->wait_on = &warehouse->full;
+            return TASK_WAIT;
+        }
+        int taken = fetch_products(items, got, &t->depth);
+        if (taken == -1) return TASK_RUN;
+        t->owed -= taken;
+        t->taken = taken;
+        spill_refill(); // the slots just freed go to spilled items first
+        for (int i = 0; payload_max && i < taken; i++) items[i] = payload_consume(items[i]);
+        t->sleep_ms = 1000; // Simulate time taken to consume
+        t->at = TASK_AT_CONSUMED;
+        return TASK_SLEEP;
+    }
+    case TASK_AT_CONSUMED:
+        for (int i = 0; i < t->taken; i++)
+            log_event(EVENT_CONSUMED, t->id, items[i], 0, t->depth);
+        atomic_store_explicit(&last_action, PACK_ACTION(ACTION_CONSUMED, t->id, items[t->taken - 1], 0),
+                              memory_order_relaxed);
+        update_statistics(&retailer_stats[t->id - 1], 0, t->taken);
+        t->sleep_ms = 3000;
+        t->at = TASK_AT_RESTED;
+        return TASK_SLEEP;
+    case TASK_AT_RESTED:
+        t->at = TASK_AT_CLAIM;
+        return TASK_RUN;
+    }
+    return TASK_DONE;
+}
+
+// The end of the thread functions: tickets back, counts down, coordinator poked
+void task_finish(struct task* t) {
+    if (t->retailer) {
+        if (t->owed) return_tickets(&warehouse->simulation_count, t->owed, NULL);
+        if (atomic_fetch_sub(&retailers_left, 1) == 1) notify_coordinator();
+    } else {
+        atomic_fetch_sub(&suppliers_left, 1);
+    }
+    free(t->items);
+    free(t);
+    if (atomic_fetch_sub(&tasks_alive, 1) == 1) {
+        pthread_mutex_lock(&task_lock);
+        pthread_cond_broadcast(&task_ready);
+        pthread_mutex_unlock(&task_lock);
+    }
+}
+
+void* task_worker(void* arg) {
+    trace_attach("Worker", (int)(long)arg);
+    for (;;) {
+        pthread_mutex_lock(&task_lock);
+        while (!task_queue.head && atomic_load(&tasks_alive) > 0)
+            pthread_cond_wait(&task_ready, &task_lock);
+        struct task* t = task_queue.head;
+        if (t) {
+            task_queue.head = t->next;
+            if (!task_queue.head) task_queue.tail = NULL;
+        }
+        pthread_mutex_unlock(&task_lock);
+        if (!t) break;
+
+        my_rng = t->rng;
+        burst_on = t->burst_on;
+        burst_left_ms = t->burst_left_ms;
+        wrr_rank = t->wrr_rank;
+        wrr_left = t->wrr_left;
+        int next = t->retailer ? retailer_step(t) : supplier_step(t);
+        t->rng = my_rng;
+        t->burst_on = burst_on;
+        t->burst_left_ms = burst_left_ms;
+        t->wrr_rank = wrr_rank;
+        t->wrr_left = wrr_left;
+        atomic_fetch_add_explicit(&task_steps, 1, memory_order_relaxed);
+
+        // The task is handed on last: from there another worker may run it
+        if (next == TASK_SLEEP) {
+            task_sleep(t);
+        } else if (next == TASK_WAIT) {
+            task_park(t);
+        } else if (next == TASK_DONE) {
+            task_finish(t);
+        } else {
+            struct task_list one = {t, t};
+            t->next = NULL;
+            task_runnable(&one);
+        }
+    }
+    return NULL;
+}
+
+// Turns the wheel once per tick, catching up on ticks it missed
+void* task_ticker_main(void* arg) {
+    (void)arg;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (atomic_load(&tasks_alive) > 0) {
+        next.tv_nsec += TASK_TICK_NS;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        uint64_t now_tick = (now_ns() - wheel_origin_ns) / TASK_TICK_NS;
+        struct task_list due = {NULL, NULL};
+        pthread_mutex_lock(&wheel_lock);
+        while (wheel_tick < now_tick) {
+            struct task_list* slot = &task_wheel[++wheel_tick % TASK_WHEEL_SLOTS];
+            struct task* t = slot->head;
+            slot->head = slot->tail = NULL;
+            while (t) {
+                struct task* after = t->next;
+                if (t->rounds == 0) {
+                    task_list_push(&due, t);
+                } else {
+                    t->rounds--;
+                    task_list_push(slot, t);
+                }
+                t = after;
+            }
+        }
+        pthread_mutex_unlock(&wheel_lock);
+        task_runnable(&due);
+    }
+    return NULL;
+}
+
+// Queue every supplier and retailer as a task and start the pool
+void start_tasks() {
+    int count = NUM_PRODUCERS + NUM_CONSUMERS;
+    wheel_origin_ns = now_ns();
+    wheel_tick = 0;
+    atomic_store(&tasks_alive, count);
+    struct task_list all = {NULL, NULL};
+    for (int i = 0; i < count; i++) {
+        struct task* t = calloc(1, sizeof(struct task));
+        int retailer = i >= NUM_PRODUCERS;
+        int slots = retailer ? retailer_batch : 3 * supplier_batch;
+        if (!t || !(t->items = malloc(slots * sizeof(int)))) {
+            printf("[ERROR] Could not allocate task %d!\n", i + 1);
+            exit(1);
+        }
+        t->retailer = retailer;
+        t->id = retailer ? i - NUM_PRODUCERS + 1 : i + 1;
+        if (!retailer) pcg32_seed(&t->rng, workload_seed, t->id);
+        t->wrr_rank = -1;
+        task_list_push(&all, t);
+    }
+    task_runnable(&all);
+
+    task_threads = malloc(task_workers * sizeof(pthread_t));
+    if (!task_threads) {
+        printf("[ERROR] Could not allocate the task workers!\n");
+        exit(1);
+    }
+    for (int i = 0; i < task_workers; i++)
+        spawn_thread(&task_threads[i], retailer_cpus, retailer_cpu_count, i, task_worker, (void*)(long)(i + 1));
+    if (pthread_create(&task_ticker, NULL, task_ticker_main, NULL) != 0) {
+        printf("[ERROR] Could not start the task timer!\n");
+        exit(1);
+    }
+}
+
+// After begin_shutdown(SHUTDOWN_STOP): every task runs to its end, then the pool exits
+void stop_tasks() {
+    for (int i = 0; i < task_workers; i++)
+        pthread_join(task_threads[i], NULL);
+    pthread_join(task_ticker, NULL);
+    free(task_threads);
+    task_threads = NULL;
+}
+
+// murmur3's finalizer: item ids are small and dense, ring points must not be
+uint32_t shard_hash(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x85ebca6bu;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35u;
+    x ^= x >> 16;
+    return x;
+}
+
+static int shard_point_cmp(const void* a, const void* b) {
+    uint32_t x = ((const struct shard_point*)a)->hash, y = ((const struct shard_point*)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+// SHARD_VNODES points per shard, so each owns many small arcs of the ring
+// and an item keeps its shard when --shards changes unless its arc moves
+void shard_ring_init() {
+    shard_points = 0;
+    for (int s = 0; s < shard_count; s++)
+        for (int v = 0; v < SHARD_VNODES; v++)
+            shard_ring[shard_points++] = (struct shard_point){shard_hash(((uint32_t)s << 16 | v) ^ 0x9e3779b9u), s};
+    qsort(shard_ring, shard_points, sizeof(shard_ring[0]), shard_point_cmp);
+}
+
+// The shard owning an item: the first ring point at or after its hash
+int shard_of(int item) {
+    uint32_t h = shard_hash((uint32_t)item);
+    int lo = 0, hi = shard_points;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (shard_ring[mid].hash < h) lo = mid + 1;
+        else hi = mid;
+    }
+    return shard_ring[lo == shard_points ? 0 : lo].shard;
+}
+
+// Point this thread's warehouse views at shard s
+void shard_enter(int s) {
+    my_shard = s;
+    warehouse = shard_state[s];
+    level_slots = shard_slots[s];
+    level_rings = shard_rings[s];
+}
+
+// What shard s holds at level rank, or on all levels for rank -1; for observers
+int shard_level_stock(int s, int rank) {
+    int was = my_shard, total = 0;
+    shard_enter(s);
+    for (int r = rank < 0 ? 0 : rank; r < (rank < 0 ? priority_levels : rank + 1); r++)
+        total += level_stock(r);
+    shard_enter(was);
+    return total;
+}
+
+// Items on the shelves of every shard
+int stock_total() {
+    int total = 0;
+    for (int s = 0; s < shard_count; s++) total += shard_level_stock(s, -1);
+    return total;
+}
+
+// Stock credits of every shard: the depth reported with sharded events
+int shards_depth() {
+    int total = 0;
+    for (int s = 0; s < shard_count; s++) total += fsem_value(&shard_state[s]->full);
+    return total;
+}
+
+// Reorder a batch, stably, by the shard of each item, counts[s] of them for
+// shard s, so that it can go out one shard after the other
+void route_batch(int* items, int* priorities, int count, int* counts) {
+    int shard[MAX_BATCH], starts[MAX_SHARDS], sorted_items[MAX_BATCH], sorted_priorities[MAX_BATCH];
+    memset(counts, 0, shard_count * sizeof(int));
+    for (int i = 0; i < count; i++) counts[shard[i] = shard_of(items[i])]++;
+    for (int s = 0, at = 0; s < shard_count; s++) {
+        starts[s] = at;
+        at += counts[s];
+    }
+    for (int i = 0; i < count; i++) {
+        int at = starts[shard[i]]++;
+        sorted_items[at] = items[i];
+        sorted_priorities[at] = priorities[i];
+    }
+    memcpy(items, sorted_items, count * sizeof(int));
+    memcpy(priorities, sorted_priorities, count * sizeof(int));
+}
+
+// admit_products for a batch laid out by route_batch. Returns how many went
+// in, in order; a shutdown that cuts one shard's part short ends the batch.
+int shard_admit(const int* items, const int* priorities, int count, const int* counts, int* depth) {
+    if (shard_count == 1) return admit_products(items, priorities, count, depth);
+    int done = 0;
+    for (int s = 0; s < shard_count && done < count; s++) {
+        if (counts[s] == 0) continue;
+        shard_enter(s);
+        int n = admit_products(items + done, priorities + done, counts[s], NULL);
+        atomic_fetch_add_explicit(&shard_counters[s].stored, n, memory_order_relaxed);
+        done += n;
+        if (n < counts[s]) break;
+    }
+    shard_enter(0);
+    if (depth) *depth = shards_depth();
+    return done;
+}
+
+// take_products for a retailer with a home shard: what is there first, then
+// up to half of the fullest other shard, else a short wait at home before
+// looking around again. Returns -1 when nothing was taken.
+int shard_take(int* items, int max, int* depth) {
+    int from = home_shard;
+    shard_enter(from);
+    int got = fsem_take(&warehouse->full, max);
+    if (got == 0) {
+        int most = 0;
+        for (int s = 0; s < shard_count; s++) {
+            int stocked = fsem_value(&shard_state[s]->full);
+            if (s != home_shard && stocked > most) {
+                most = stocked;
+                from = s;
+            }
+        }
+        if (from != home_shard) {
+            shard_enter(from);
+            got = fsem_take(&warehouse->full, max < (most + 1) / 2 ? max : (most + 1) / 2);
+        }
+    }
+    if (got == 0) {
+        from = home_shard;
+        shard_enter(from);
+        INSTR_START(instr_start);
+        uint64_t trace_start = trace_begin(TRACE_WAIT_STOCK);
+        got = fsem_wait_upto_ms(&warehouse->full, max, SHARD_STEAL_POLL_MS);
+        trace_end(TRACE_WAIT_STOCK, trace_start, got);
+        INSTR_END(INSTR_FULL_WAIT, instr_start);
+    }
+    int taken = got ? fetch_products(items, got, NULL) : -1;
+    if (taken > 0) {
+        atomic_fetch_add_explicit(&shard_counters[from].taken, taken, memory_order_relaxed);
+        if (from != home_shard) atomic_fetch_add_explicit(&shard_counters[from].stolen, taken, memory_order_relaxed);
+    }
+    shard_enter(0);
+    if (depth) *depth = shards_depth();
+    return taken;
+}
+
+// Enqueue time is only needed when the deadline policy compares queue heads
+static uint64_t enqueue_stamp() {
+    return schedule_policy == POLICY_DEADLINE ? now_ns() : 0;
+}
+
+// Add product to its priority level (caller holds mutex unless the engine is lock-free)
+void add_product(int item, int priority) {
+    int rank = LEVEL_RANK(priority);
+    if (queue_engine == ENGINE_LOCKFREE) {
+        // A slot was already reserved through "empty", so a full ring only means
+        // a consumer has claimed the cell but not released it yet
+        while (ring_push(&level_rings[rank], item, enqueue_stamp()) != 0)
+            sched_yield();
+        level_mark_stocked(rank);
+        return;
+    }
+
+    // Cannot happen while every item is backed by an "empty" credit; dropping
+    // here would silently lose the item and leak the credit
+    struct level_queue* q = &warehouse->levels[rank];
+    size_t in = atomic_load_explicit(&q->in, memory_order_relaxed);
+    if (in - q->out_cached >= buffer_capacity) {
+        q->out_cached = atomic_load_explicit(&q->out, memory_order_relaxed);
+        if (in - q->out_cached >= buffer_capacity) {
+            printf("[ERROR] Level %d overflow: capacity accounting is broken!\n", rank);
+            exit(1);
+        }
+    }
+    level_slots[rank][in & buffer_mask].item = item;
+    level_slots[rank][in & buffer_mask].stamp = enqueue_stamp();
+    atomic_store_explicit(&q->in, in + 1, memory_order_relaxed);
+    level_mark_stocked(rank);
+}
+
+// Extract the next product as chosen by the scheduling policy
+// (caller holds mutex unless the engine is lock-free)
+int extract_product() {
+    unsigned mask = atomic_load_explicit(&warehouse->nonempty_levels, memory_order_acquire);
+    while (mask) {
+        long quota;
+        int rank = pick_level(mask, &quota);
+        int item;
+
+        if (queue_engine == ENGINE_LOCKFREE) {
+            if (ring_pop(&level_rings[rank], &item)) return item;
+        } else {
+            struct level_queue* q = &warehouse->levels[rank];
+            size_t out = atomic_load_explicit(&q->out, memory_order_relaxed);
+            if (q->in_cached == out) q->in_cached = atomic_load_explicit(&q->in, memory_order_relaxed);
+            if (q->in_cached != out) {
+                item = level_slots[rank][out & buffer_mask].item;
+                atomic_store_explicit(&q->out, out + 1, memory_order_relaxed);
+                if (q->in_cached == out + 1) level_maybe_empty(rank);
+                return item;
+            }
+        }
+        level_maybe_empty(rank);
+        mask &= ~(1u << rank);
+    }
+    if (queue_engine == ENGINE_MUTEX) log_error("Buffer underflow");
+    return -1;
+}
+
+// Choose the level to serve next among the non-empty ones in mask (by rank).
+// quota receives how many items may be taken from it before picking again.
+int pick_level(unsigned mask, long* quota) {
+    if (schedule_policy == POLICY_WRR) {
+        // Stay on the current level until its weight is used up or it runs dry,
+        // then move on to the next non-empty level in rank order
+        if (wrr_rank < 0 || wrr_left <= 0 || !(mask & (1u << wrr_rank))) {
+            unsigned after = wrr_rank < 0 || wrr_rank >= 31 ? 0 : mask & ~((2u << wrr_rank) - 1);
+            wrr_rank = __builtin_ctz(after ? after : mask);
+            wrr_left = wrr_weights[wrr_rank] ? wrr_weights[wrr_rank] : priority_levels - wrr_rank;
+        }
+        *quota = wrr_left--;
+        return wrr_rank;
+    }
+
+    if (schedule_policy == POLICY_DEADLINE && (mask & (mask - 1))) {
+        // Rank r has a budget of (r + 1) * deadline_ms; serve the head whose
+        // budget runs out first so low levels are never starved
+        int best = __builtin_ctz(mask);
+        uint64_t best_due = UINT64_MAX;
+        for (unsigned m = mask; m; m &= m - 1) {
+            int rank = __builtin_ctz(m);
+            uint64_t stamp = level_head_stamp(rank);
+            if (stamp == 0) continue;
+            uint64_t due = stamp + (uint64_t)(rank + 1) * deadline_ms * 1000000ULL;
+            if (due < best_due) {
+                best_due = due;
+                best = rank;
+            }
+        }
+        *quota = 1;
+        return best;
+    }
+
+    *quota = MAX_BATCH;
+    return __builtin_ctz(mask);
+}
+
+// Enqueue time of the oldest item of a level, or 0 if it is (momentarily) empty
+uint64_t level_head_stamp(int rank) {
+    if (queue_engine == ENGINE_STEAL) {
+        struct steal_deque* d = &steal_source->levels[rank];
+        size_t top = atomic_load_explicit(&d->top, memory_order_acquire);
+        if (top == atomic_load_explicit(&d->bottom, memory_order_acquire)) return 0;
+        return atomic_load_explicit(&d->slots[top & buffer_mask].stamp, memory_order_relaxed);
+    }
+    if (queue_engine == ENGINE_LOCKFREE) {
+        struct mpmc_ring* r = &level_rings[rank];
+        size_t pos = atomic_load_explicit(&r->dequeue_pos, memory_order_relaxed);
+        struct ring_cell* cell = &r->cells[pos & r->mask];
+        if (atomic_load_explicit(&cell->seq, memory_order_acquire) != pos + 1) return 0;
+        return atomic_load_explicit(&cell->stamp, memory_order_relaxed);
+    }
+    struct level_queue* q = &warehouse->levels[rank];
+    size_t out = atomic_load_explicit(&q->out, memory_order_relaxed);
+    return atomic_load_explicit(&q->in, memory_order_relaxed) != out ? level_slots[rank][out & buffer_mask].stamp : 0;
+}
+
+void level_mark_stocked(int rank) {
+    unsigned bit = 1u << rank;
+    // Skip the read-modify-write (and the cache line transfer) when already set
+    if (!(atomic_load_explicit(&warehouse->nonempty_levels, memory_order_relaxed) & bit))
+        atomic_fetch_or_explicit(&warehouse->nonempty_levels, bit, memory_order_release);
+}
+
+// Clear a level's bit; for lock-free rings re-set it if a producer got in meanwhile
+void level_maybe_empty(int rank) {
+    unsigned bit = 1u << rank;
+    atomic_fetch_and_explicit(&warehouse->nonempty_levels, ~bit, memory_order_acq_rel);
+    if (level_stock(rank) > 0)
+        atomic_fetch_or_explicit(&warehouse->nonempty_levels, bit, memory_order_release);
+}
+
+// Wait for a free slot and hand the item to the active engine.
+// Returns the stock level right after the item went in.
+int put_product(int item, int priority) {
+    int depth = 0;
+    put_products(&item, &priority, 1, &depth);
+    return depth;
+}
+
+// Wait for a stocked slot and take the next item, urgent ones first.
+// Returns -1 when woken up without an item (e.g. during shutdown).
+// If depth is not NULL it receives the stock level left behind.
+int take_product(int* depth) {
+    int item;
+    return take_products(&item, 1, depth) == 1 ? item : -1;
+}
+
+static long futex(atomic_int* addr, int op, int value) {
+    return syscall(SYS_futex, addr, op, value, NULL, NULL, 0);
+}
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Take the warehouse mutex, timing the wait only when it is contended
+static void lock_warehouse() {
+    INSTR_START(instr_start);
+    int err = pthread_mutex_trylock(&warehouse->mutex);
+    if (err == EBUSY) {
+        uint64_t start = now_ns();
+        err = pthread_mutex_lock(&warehouse->mutex);
+        wait_hist_record(&lock_wait, now_ns() - start);
+    }
+    if (err == EOWNERDEAD) shm_recover(); // only robust (shared-memory) mutexes report this
+    INSTR_END(INSTR_LOCK_WAIT, instr_start);
+    INSTR_HOLD_START();
+}
+
+static void unlock_warehouse() {
+    INSTR_HOLD_END();
+    pthread_mutex_unlock(&warehouse->mutex);
+}
+
+void fsem_init(struct fsem* s, int value) {
+    memset(s, 0, sizeof(*s));
+    atomic_store(&s->count, value);
+    atomic_store(&s->spin_limit, fsem_spin_max / 4);
+}
+
+// Take up to n units without blocking; returns how many were taken
+int fsem_take(struct fsem* s, int n) {
+    int c = atomic_load_explicit(&s->count, memory_order_relaxed);
+    while (c > 0) {
+        int take = c < n ? c : n;
+        if (atomic_compare_exchange_weak_explicit(&s->count, &c, c - take,
+                                                  memory_order_acquire, memory_order_relaxed))
+            return take;
+    }
+    return 0;
+}
+
+// Block until at least one unit is available, then take up to n at once.
+// Never sleeping while holding units keeps batched callers deadlock-free.
+int fsem_wait_upto(struct fsem* s, int n) {
+    int got = fsem_take(s, n);
+    if (got) return got;
+    uint64_t start = now_ns();
+
+    // Spin first: a credit is often only a few hundred cycles away. The limit
+    // grows when spinning pays off and shrinks when the waiter had to park.
+    int limit = atomic_load_explicit(&s->spin_limit, memory_order_relaxed);
+    for (int i = 0; i < limit; i++) {
+        cpu_relax();
+        if (atomic_load_explicit(&s->count, memory_order_relaxed) > 0 && (got = fsem_take(s, n))) {
+            atomic_fetch_add_explicit(&s->spin_hits, 1, memory_order_relaxed);
+            if (limit < fsem_spin_max)
+                atomic_store_explicit(&s->spin_limit, limit * 2 < fsem_spin_max ? limit * 2 : fsem_spin_max,
+                                      memory_order_relaxed);
+            wait_hist_record(&s->wait, now_ns() - start);
+            return got;
+        }
+    }
+    if (limit > 0) atomic_store_explicit(&s->spin_limit, limit / 2, memory_order_relaxed);
+
+    // Announce the waiter before the last check so a concurrent post either
+    // sees it and wakes us, or its count is seen by the futex value check
+    atomic_fetch_add(&s->waiters, 1);
+    int woken = 0;
+    while (!(got = fsem_take(s, n))) {
+        if (woken) atomic_fetch_add_explicit(&s->spurious, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&s->parks, 1, memory_order_relaxed);
+        futex(&s->count, FUTEX_WAIT | futex_private, 0);
+        woken = 1;
+    }
+    atomic_fetch_sub(&s->waiters, 1);
+    wait_hist_record(&s->wait, now_ns() - start);
+    return got;
+}
+
+// fsem_wait_upto that gives up after timeout_ms: returns 0 when no unit came
+// in time. Parks right away, as the caller only ends up here when full.
+int fsem_wait_upto_ms(struct fsem* s, int n, long timeout_ms) {
+    int got = fsem_take(s, n);
+    if (got) return got;
+    uint64_t start = now_ns(), deadline = start + (uint64_t)timeout_ms * 1000000ULL;
+    atomic_fetch_add(&s->waiters, 1);
+    while (!(got = fsem_take(s, n))) {
+        uint64_t now = now_ns();
+        if (now >= deadline) break;
+        struct timespec timeout = {(time_t)((deadline - now) / 1000000000ULL), (long)((deadline - now) % 1000000000ULL)};
+        atomic_fetch_add_explicit(&s->parks, 1, memory_order_relaxed);
+        syscall(SYS_futex, &s->count, FUTEX_WAIT | futex_private, 0, &timeout, NULL, 0);
+    }
+    atomic_fetch_sub(&s->waiters, 1);
+    wait_hist_record(&s->wait, now_ns() - start);
+    return got;
+}
+
+void fsem_post_n(struct fsem* s, int n) {
+    if (n <= 0) return;
+    atomic_fetch_add(&s->count, n);
+    if (atomic_load(&s->waiters) > 0) {
+        long woke = futex(&s->count, FUTEX_WAKE | futex_private, n);
+        if (woke > 0) atomic_fetch_add_explicit(&s->unparks, woke, memory_order_relaxed);
+    }
+    if (task_workers) task_wake(s, n);
+}
+
+// Block until s has units, without taking any: shared-memory mode takes them
+// under the mutex. Parks with a timeout so that a shutdown, which does not
+// post credits other processes may be counting on, is noticed.
+void fsem_wait_nonzero(struct fsem* s) {
+    if (fsem_value(s) > 0) return;
+    uint64_t start = now_ns();
+    struct timespec timeout = {0, 100000000L};
+    atomic_fetch_add(&s->waiters, 1);
+    while (fsem_value(s) <= 0 && atomic_load(&shutdown_phase) != SHUTDOWN_STOP) {
+        atomic_fetch_add_explicit(&s->parks, 1, memory_order_relaxed);
+        syscall(SYS_futex, &s->count, FUTEX_WAIT | futex_private, 0, &timeout, NULL, 0);
+    }
+    atomic_fetch_sub(&s->waiters, 1);
+    wait_hist_record(&s->wait, now_ns() - start);
+}
+
+// Units currently available (a snapshot)
+int fsem_value(struct fsem* s) {
+    return atomic_load_explicit(&s->count, memory_order_relaxed);
+}
+
+// Hand got items to the engine, their "empty" credits already held, and post
+// their "full" credits
+void store_products(const int* items, const int* priorities, int got, int* depth) {
+    if (queue_engine != ENGINE_MUTEX) {
+        // Group the reservation by level so each ring (or deque) is touched once
+        int grouped[MAX_BATCH];
+        int counts[MAX_LEVELS] = {0}, starts[MAX_LEVELS] = {0};
+        for (int i = 0; i < got; i++) counts[LEVEL_RANK(priorities[i])]++;
+        for (int r = 0, at = 0; r < priority_levels; r++) {
+            starts[r] = at;
+            at += counts[r];
+        }
+        int fill[MAX_LEVELS];
+        memcpy(fill, starts, sizeof(fill));
+        for (int i = 0; i < got; i++) grouped[fill[LEVEL_RANK(priorities[i])]++] = items[i];
+
+        uint64_t stamp = enqueue_stamp();
+        struct retailer_deques* target = queue_engine == ENGINE_STEAL ? &steal_deques[steal_route_pick()] : NULL;
+        for (int r = 0; r < priority_levels; r++) {
+            if (!counts[r]) continue;
+            if (target) {
+                deque_push_n(&target->levels[r], grouped + starts[r], counts[r], stamp);
+                if (!(atomic_load_explicit(&target->nonempty, memory_order_relaxed) & (1u << r)))
+                    atomic_fetch_or_explicit(&target->nonempty, 1u << r, memory_order_release);
+            } else {
+                ring_push_n(&level_rings[r], grouped + starts[r], counts[r], stamp);
+                level_mark_stocked(r);
+            }
+        }
+        // Summing every deque would touch all retailers' lines; the published
+        // item count is what "full" holds anyway
+        if (target) {
+            if (depth) *depth = fsem_value(&warehouse->full) + got;
+        } else {
+            if (depth) *depth = normal_stock() + urgent_stock();
+        }
+    } else {
+        lock_warehouse();
+        for (int i = 0; i < got; i++)
+            add_product(items[i], priorities[i]);
+        if (depth) *depth = normal_stock() + urgent_stock();
+        unlock_warehouse();
+    }
+    fsem_post_n(&warehouse->full, got);
+}
+
+// Bulk variant of put_product: every reservation of free slots is handed to
+// the engine in one go (one lock round-trip, or one fetch_add per ring).
+// Returns how many items went in: fewer than count only when a shutdown
+// stopped the wait. If depth is not NULL it receives the stock level after
+// the last one.
+int put_products(const int* items, const int* priorities, int count, int* depth) {
+    if (shm) return shm_put_products(items, priorities, count, depth);
+    int done = 0;
+    while (done < count) {
+        INSTR_START(instr_start);
+        uint64_t trace_start = trace_begin(TRACE_WAIT_SPACE);
+        int got = fsem_wait_upto(&warehouse->empty, count - done);
+        trace_end(TRACE_WAIT_SPACE, trace_start, got);
+        INSTR_END(INSTR_EMPTY_WAIT, instr_start);
+        if (atomic_load_explicit(&shutdown_phase, memory_order_relaxed) == SHUTDOWN_STOP) {
+            fsem_post_n(&warehouse->empty, got); // pass the wakeup on to the next blocked supplier
+            break;
+        }
+        store_products(items + done, priorities + done, got, depth);
+        done += got;
+    }
+    return done;
+}
+
+const char* overflow_name(int policy) {
+    static const char* names[] = {"block", "timeout", "drop-newest", "drop-oldest-normal", "spill"};
+    return names[policy];
+}
+
+// put_products for the simulation's suppliers, with the --overflow policy
+// deciding what happens to items that find the warehouse full. Returns how
+// many went in (or to the spill file) in order; the rest were dropped, or a
+// shutdown stopped the wait.
+int admit_products(const int* items, const int* priorities, int count, int* depth) {
+    if (overflow_policy == OVERFLOW_BLOCK) {
+        if (fsem_value(&warehouse->empty) < count) atomic_fetch_add_explicit(&overflow.waited, 1, memory_order_relaxed);
+        return put_products(items, priorities, count, depth);
+    }
+    if (overflow_policy == OVERFLOW_SPILL) spill_refill(); // older items first where there is room
+
+    int done = 0;
+    while (done < count && atomic_load_explicit(&shutdown_phase, memory_order_relaxed) != SHUTDOWN_STOP) {
+        int seen = atomic_load(&snapshot_epoch);
+        int got = fsem_take(&warehouse->empty, count - done);
+        if (!got) {
+            if (!overflow_enter(seen)) continue; // a snapshot had the credits: look again
+            int left = count - done;
+            if (overflow_policy == OVERFLOW_DROP_NEWEST) {
+                atomic_fetch_add_explicit(&overflow.dropped, left, memory_order_relaxed);
+                overflow_leave();
+                break;
+            }
+            if (overflow_policy == OVERFLOW_SPILL) {
+                spill_append(items + done, priorities + done, left);
+                atomic_fetch_add_explicit(&overflow.spilled, left, memory_order_relaxed);
+                overflow_leave();
+                done = count;
+                spill_refill(); // a retailer may have freed a slot after missing the new records
+                break;
+            }
+            if (overflow_policy == OVERFLOW_DROP_OLDEST && priorities[done] > 0 &&
+                evict_normal_for(items[done], priorities[done])) {
+                atomic_fetch_add_explicit(&overflow.evicted, 1, memory_order_relaxed);
+                overflow_leave();
+                // The evicted item will never be consumed: let a supplier make another
+                return_tickets(&warehouse->supply_count, 1, NULL);
+                done++;
+                continue;
+            }
+            overflow_leave();
+
+            atomic_fetch_add_explicit(&overflow.waited, 1, memory_order_relaxed);
+            INSTR_START(instr_start);
+            uint64_t trace_start = trace_begin(TRACE_WAIT_SPACE);
+            seen = atomic_load(&snapshot_epoch);
+            if (overflow_policy == OVERFLOW_TIMEOUT)
+                got = fsem_wait_upto_ms(&warehouse->empty, left, overflow_timeout_ms);
+            else
+                got = fsem_wait_upto(&warehouse->empty, overflow_policy == OVERFLOW_DROP_OLDEST ? 1 : left);
+            trace_end(TRACE_WAIT_SPACE, trace_start, got);
+            INSTR_END(INSTR_EMPTY_WAIT, instr_start);
+            if (!got) {
+                if (!overflow_enter(seen)) continue; // timed out on a snapshot, not on a full warehouse
+                atomic_fetch_add_explicit(&overflow.timed_out, left, memory_order_relaxed);
+                overflow_leave();
+                break;
+            }
+            if (atomic_load_explicit(&shutdown_phase, memory_order_relaxed) == SHUTDOWN_STOP) {
+                fsem_post_n(&warehouse->empty, got);
+                break;
+            }
+        }
+        store_products(items + done, priorities + done, got, depth);
+        done += got;
+    }
+    return done;
+}
+
+// Make room for an urgent item by dropping the oldest normal one, in place
+// and without touching the "empty" credits. Returns 0 when there is no normal
+// item to drop.
+int evict_normal_for(int item, int priority) {
+    int normal = LEVEL_RANK(0), victim;
+    if (queue_engine == ENGINE_MUTEX) {
+        lock_warehouse();
+        struct level_queue* q = &warehouse->levels[normal];
+        size_t out = atomic_load_explicit(&q->out, memory_order_relaxed);
+        size_t in = atomic_load_explicit(&q->in, memory_order_relaxed);
+        if (in == out) {
+            unlock_warehouse();
+            return 0;
+        }
+        victim = level_slots[normal][out & buffer_mask].item;
+        atomic_store_explicit(&q->out, out + 1, memory_order_relaxed);
+        q->in_cached = in; // a copy older than the new out would let extract_product read past in
+        if (in == out + 1) level_maybe_empty(normal);
+        add_product(item, priority);
+        unlock_warehouse();
+    } else {
+        // Hold the victim's "full" credit so that no retailer counts on it
+        // meanwhile; store_products posts it again for the urgent item
+        if (!fsem_take(&warehouse->full, 1)) return 0;
+        int n = 0;
+        if (queue_engine == ENGINE_LOCKFREE)
+            n = ring_pop(&level_rings[normal], &victim);
+        else
+            for (int i = 0; i < NUM_CONSUMERS && !n; i++) n = deque_take_n(&steal_deques[i].levels[normal], &victim, 1);
+        if (!n) {
+            fsem_post_n(&warehouse->full, 1);
+            return 0;
+        }
+        store_products(&item, &priority, 1, NULL);
+    }
+    if (payload_max) payload_consume(victim);
+    return 1;
+}
+
+// Create the first segment up front, so that a bad path fails before the run
+void spill_open() {
+    if (overflow_policy != OVERFLOW_SPILL) return;
+    spill_segment_records = spill_segment_bytes / sizeof(struct spill_record);
+    spill_enabled = 1;
+    spill_head = spill_tail = spill_segment_get();
+}
+
+// Items still spilled at the end were never consumed; the files go with them
+void spill_close() {
+    if (!spill_enabled) return;
+    pthread_mutex_lock(&spill_lock);
+    for (int pass = 0; pass < 2; pass++) {
+        struct spill_segment* seg = pass ? spill_spare : spill_head;
+        while (seg) {
+            struct spill_segment* next = seg->next;
+            char path[4096];
+            snprintf(path, sizeof(path), "%s.%06u", spill_path, seg->seq);
+            munmap(seg->records, spill_segment_bytes);
+            close(seg->fd);
+            unlink(path);
+            free(seg);
+            seg = next;
+        }
+    }
+    spill_head = spill_tail = spill_spare = NULL;
+    spill_enabled = 0;
+    pthread_mutex_unlock(&spill_lock);
+}
+
+// A spare segment, or a new one; called under spill_lock (or before any thread runs)
+struct spill_segment* spill_segment_get() {
+    struct spill_segment* seg = spill_spare;
+    if (seg) {
+        spill_spare = seg->next;
+        spill_spares--;
+        spill_segments_recycled++;
+    } else {
+        char path[4096];
+        seg = calloc(1, sizeof(struct spill_segment));
+        if (!seg) {
+            printf("[ERROR] Could not allocate a spill segment!\n");
+            exit(1);
+        }
+        seg->seq = spill_next_seq++;
+        snprintf(path, sizeof(path), "%s.%06u", spill_path, seg->seq);
+        seg->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (seg->fd < 0 || ftruncate(seg->fd, (off_t)spill_segment_bytes) != 0) {
+            printf("[ERROR] Could not create spill segment %s: %s\n", path, strerror(errno));
+            exit(1);
+        }
+        seg->records = mmap(NULL, spill_segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+        if (seg->records == MAP_FAILED) {
+            printf("[ERROR] Could not map spill segment %s: %s\n", path, strerror(errno));
+            exit(1);
+        }
+        madvise(seg->records, spill_segment_bytes, MADV_SEQUENTIAL);
+        spill_segments_created++;
+    }
+    seg->next = NULL;
+    seg->written = seg->read = 0;
+    return seg;
+}
+
+// Retire a consumed segment; called under spill_lock
+void spill_segment_put(struct spill_segment* seg) {
+    if (spill_spares < SPILL_SPARE_SEGMENTS) {
+        // Its pages hold nothing of value any more: drop them instead of writing them back
+        madvise(seg->records, spill_segment_bytes, MADV_REMOVE);
+        seg->next = spill_spare;
+        spill_spare = seg;
+        spill_spares++;
+        return;
+    }
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.%06u", spill_path, seg->seq);
+    munmap(seg->records, spill_segment_bytes);
+    close(seg->fd);
+    unlink(path);
+    free(seg);
+}
+
+void spill_append(const int* items, const int* priorities, int count) {
+    pthread_mutex_lock(&spill_lock);
+    for (int i = 0; i < count; i++) {
+        if (spill_tail->written == spill_segment_records) {
+            spill_tail->next = spill_segment_get();
+            spill_tail = spill_tail->next;
+        }
+        spill_tail->records[spill_tail->written++] = (struct spill_record){items[i], priorities[i]};
+    }
+    atomic_fetch_add(&spill_pending, count);
+    pthread_mutex_unlock(&spill_lock);
+}
+
+// Move spilled items back in, oldest first, for as long as there are free
+// slots. Suppliers call it after spilling and retailers after taking (so the
+// in-memory stock is always served first); the fences make sure one of the
+// two sees the other's side.
+void spill_refill() {
+    if (!spill_enabled) return;
+    atomic_thread_fence(memory_order_seq_cst);
+    while (atomic_load(&spill_pending) > 0) {
+        int pending = atomic_load(&spill_pending);
+        int got = fsem_take(&warehouse->empty, pending < MAX_BATCH ? pending : MAX_BATCH);
+        if (!got) return;
+        int items[MAX_BATCH], priorities[MAX_BATCH];
+        int n = 0;
+        pthread_mutex_lock(&spill_lock);
+        while (n < got) {
+            struct spill_segment* seg = spill_head;
+            if (seg->read == seg->written) {
+                if (seg == spill_tail) {
+                    seg->read = seg->written = 0; // caught up: start the segment over
+                    break;
+                }
+                spill_head = seg->next;
+                spill_segment_put(seg);
+                // Start reading the next segment ahead of the refills
+                madvise(spill_head->records, spill_segment_bytes, MADV_WILLNEED);
+                continue;
+            }
+            size_t chunk = seg->written - seg->read;
+            if (chunk > (size_t)(got - n)) chunk = got - n;
+            for (size_t i = 0; i < chunk; i++) {
+                items[n] = seg->records[seg->read + i].item;
+                priorities[n++] = seg->records[seg->read + i].priority;
+            }
+            seg->read += chunk;
+        }
+        atomic_fetch_sub(&spill_pending, n);
+        pthread_mutex_unlock(&spill_lock);
+
+        fsem_post_n(&warehouse->empty, got - n); // another refiller got there first
+        if (n == 0) return;
+        store_products(items, priorities, n, NULL);
+        atomic_fetch_add_explicit(&overflow.refilled, n, memory_order_relaxed);
+    }
+}
+
+// Copy the stock and the spill tier into out, most urgent level first and
+// oldest first within a level. Nothing may move meanwhile: the threads are
+// either joined or kept out by snapshot_take holding every credit. The mutex
+// engine's evictions move items without credits, so that engine's levels are
+// read under the lock as well.
+size_t snapshot_collect(struct spill_record* out) {
+    size_t n = 0;
+    if (queue_engine == ENGINE_MUTEX) lock_warehouse();
+    for (int r = 0; r < priority_levels; r++) {
+        int priority = priority_levels - 1 - r;
+        if (queue_engine == ENGINE_STEAL) {
+            for (int i = 0; steal_deques && i < NUM_CONSUMERS; i++) {
+                struct steal_deque* d = &steal_deques[i].levels[r];
+                size_t bottom = atomic_load(&d->bottom);
+                for (size_t at = atomic_load(&d->top); at != bottom; at++)
+                    out[n++] = (struct spill_record){atomic_load_explicit(&d->slots[at & buffer_mask].item,
+                                                                          memory_order_relaxed), priority};
+            }
+        } else if (queue_engine == ENGINE_LOCKFREE) {
+            struct mpmc_ring* ring = &level_rings[r];
+            size_t end = atomic_load(&ring->enqueue_pos);
+            for (size_t at = atomic_load(&ring->dequeue_pos); at != end; at++)
+                out[n++] = (struct spill_record){ring->cells[at & ring->mask].item, priority};
+        } else {
+            size_t in = atomic_load(&warehouse->levels[r].in);
+            for (size_t at = atomic_load(&warehouse->levels[r].out); at != in; at++)
+                out[n++] = (struct spill_record){level_slots[r][at & buffer_mask].item, priority};
+        }
+    }
+    if (queue_engine == ENGINE_MUTEX) unlock_warehouse();
+    for (struct spill_segment* seg = spill_enabled ? spill_head : NULL; seg; seg = seg->next) {
+        memcpy(out + n, seg->records + seg->read, (seg->written - seg->read) * sizeof(struct spill_record));
+        n += seg->written - seg->read;
+    }
+    if (payload_max)
+        for (size_t i = 0; i < n; i++) out[i].item = payload_item(out[i].item);
+    return n;
+}
+
+// Called by a supplier that found no space before it applies its overflow
+// policy, with snapshot_epoch as it was before it looked for the space.
+// Returns 0, once the pause is over, when a live snapshot may have been
+// holding the credits meanwhile: the caller tries again instead.
+int overflow_enter(int seen) {
+    atomic_fetch_add(&overflow_inflight, 1);
+    int epoch = atomic_load(&snapshot_epoch);
+    if (epoch == seen && !(epoch & 1)) return 1;
+    atomic_fetch_sub(&overflow_inflight, 1);
+    while ((epoch = atomic_load(&snapshot_epoch)) & 1) futex(&snapshot_epoch, FUTEX_WAIT_PRIVATE, epoch);
+    return 0;
+}
+
+void overflow_leave() {
+    atomic_fetch_sub(&overflow_inflight, 1);
+}
+
+static void snapshot_resume() {
+    atomic_fetch_add(&snapshot_epoch, 1);
+    futex(&snapshot_epoch, FUTEX_WAKE_PRIVATE, INT_MAX);
+}
+
+// Write a snapshot. With live set the threads are still running, so the
+// credits are gathered first; if a shutdown begins meanwhile the snapshot
+// is skipped, the one taken at the end will do.
+void snapshot_take(int live) {
+    int held_empty = 0, held_full = 0;
+    uint64_t pause_start = now_ns();
+    if (live) {
+        atomic_fetch_add(&snapshot_epoch, 1);
+        while (held_empty + held_full < (int)buffer_capacity) {
+            if (atomic_load(&shutdown_phase) != SHUTDOWN_NONE) {
+                fsem_post_n(&warehouse->full, held_full);
+                fsem_post_n(&warehouse->empty, held_empty);
+                snapshot_resume();
+                return;
+            }
+            held_full += fsem_take(&warehouse->full, (int)buffer_capacity - held_empty - held_full);
+            held_empty += fsem_take(&warehouse->empty, (int)buffer_capacity - held_empty - held_full);
+            if (held_empty + held_full < (int)buffer_capacity) sched_yield();
+        }
+        // Evictions move items without credits; let those under way finish
+        while (atomic_load(&overflow_inflight) > 0) sched_yield();
+    }
+
+    pthread_mutex_lock(&spill_lock);
+    size_t stocked = live ? (size_t)held_full : (size_t)(normal_stock() + urgent_stock());
+    size_t bytes = sizeof(struct snapshot_header) + (stocked + atomic_load(&spill_pending)) * sizeof(struct spill_record);
+    struct snapshot_header* snap = malloc(bytes);
+    if (!snap) {
+        printf("[ERROR] Could not allocate the snapshot!\n");
+        exit(1);
+    }
+    size_t items = snapshot_collect((struct spill_record*)(snap + 1));
+    pthread_mutex_unlock(&spill_lock);
+    uint64_t consumed = stats_total(retailer_stats, NUM_CONSUMERS, 1);
+    uint64_t produced = stats_total(supplier_stats, NUM_PRODUCERS, 0);
+    if (live) {
+        fsem_post_n(&warehouse->full, held_full);
+        fsem_post_n(&warehouse->empty, held_empty);
+        snapshot_resume();
+        uint64_t pause = now_ns() - pause_start;
+        if (pause > snapshot_pause_max_ns) snapshot_pause_max_ns = pause;
+    }
+
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    *snap = (struct snapshot_header){
+        .magic = SNAPSHOT_MAGIC,
+        .levels = (uint32_t)priority_levels,
+        .items = items,
+        .remaining = consumed < (uint64_t)snapshot_run_count ? snapshot_run_count - consumed : 0,
+        .produced = restored_produced + produced,
+        .consumed = restored_consumed + consumed,
+        .wall_ns = (uint64_t)wall.tv_sec * 1000000000ULL + wall.tv_nsec,
+    };
+    bytes = sizeof(struct snapshot_header) + items * sizeof(struct spill_record);
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", snapshot_path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    size_t done = 0;
+    while (fd >= 0 && done < bytes) {
+        ssize_t n = write(fd, (char*)snap + done, bytes - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    free(snap);
+    if (fd < 0 || done < bytes || fsync(fd) != 0 || close(fd) != 0 || rename(tmp, snapshot_path) != 0) {
+        printf("[ERROR] Could not write snapshot %s: %s\n", snapshot_path, strerror(errno));
+        if (fd >= 0) unlink(tmp);
+        return;
+    }
+    // Make the rename itself durable
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s", snapshot_path);
+    char* slash = strrchr(dir, '/');
+    if (slash) *(slash == dir ? slash + 1 : slash) = '\0';
+    int dir_fd = open(slash ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        if (fsync(dir_fd) != 0) log_error("Could not sync the snapshot directory");
+        close(dir_fd);
+    }
+    snapshots_written++;
+    snapshot_last_items = items;
+}
+
+// Periodic snapshots until a shutdown starts; sleep_ms returns as soon as it does
+void* snapshot_main(void* arg) {
+    (void)arg;
+    while (atomic_load(&shutdown_phase) == SHUTDOWN_NONE) {
+        sleep_ms(snapshot_ms);
+        if (atomic_load(&shutdown_phase) != SHUTDOWN_NONE) break;
+        snapshot_take(1);
+    }
+    return NULL;
+}
+
+void start_snapshots() {
+    snapshot_run_count = atomic_load(&warehouse->simulation_count);
+    if (!snapshot_path || snapshot_ms <= 0) return;
+    if (pthread_create(&snapshot_thread, NULL, snapshot_main, NULL) != 0) {
+        printf("[ERROR] Could not start the snapshot thread!\n");
+        exit(1);
+    }
+    snapshot_thread_started = 1;
+}
+
+// After the workers are joined: stop the periodic ones and write the final snapshot
+void stop_snapshots() {
+    if (snapshot_thread_started) pthread_join(snapshot_thread, NULL);
+    snapshot_thread_started = 0;
+    if (snapshot_path) snapshot_take(0);
+}
+
+// Map and check the --restore file before the run is set up, so that a bad
+// one fails early; it also supplies the count when none was given
+void restore_load() {
+    if (!restore_path) return;
+    uint64_t start = now_ns();
+    int fd = open(restore_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        printf("[ERROR] Could not open snapshot %s: %s\n", restore_path, strerror(errno));
+        exit(1);
+    }
+    restore_bytes = (size_t)st.st_size;
+    if (restore_bytes < sizeof(struct snapshot_header)) {
+        printf("[ERROR] %s is not a warehouse snapshot\n", restore_path);
+        exit(1);
+    }
+    restore_map = mmap(NULL, restore_bytes, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (restore_map == MAP_FAILED) {
+        printf("[ERROR] Could not map snapshot %s: %s\n", restore_path, strerror(errno));
+        exit(1);
+    }
+    madvise(restore_map, restore_bytes, MADV_SEQUENTIAL);
+    const struct snapshot_header* snap = restore_map;
+    if (snap->magic != SNAPSHOT_MAGIC ||
+        restore_bytes != sizeof(struct snapshot_header) + snap->items * sizeof(struct spill_record)) {
+        printf("[ERROR] %s is not a warehouse snapshot (or it is truncated)\n", restore_path);
+        exit(1);
+    }
+    if ((int)snap->levels > priority_levels) {
+        printf("[ERROR] Snapshot %s was taken with --levels=%u\n", restore_path, snap->levels);
+        exit(1);
+    }
+    if (snap->items > round_up_pow2(buffer_capacity) && overflow_policy != OVERFLOW_SPILL) {
+        printf("[ERROR] Snapshot %s holds %llu items, more than --capacity (try --overflow=spill)\n", restore_path,
+               (unsigned long long)snap->items);
+        exit(1);
+    }
+    if (atomic_load(&warehouse->simulation_count) <= 0 && snap->remaining > 0)
+        atomic_store(&warehouse->simulation_count, snap->remaining > INT_MAX ? INT_MAX : (int)snap->remaining);
+    restore_ms = (now_ns() - start) / 1e6;
+}
+
+// Stock the initialized warehouse from the mapped snapshot: one pass over
+// the records, handed over MAX_BATCH at a time; what does not fit goes to
+// the spill tier. Suppliers then only make what the count still needs.
+void restore_stock() {
+    if (!restore_map) return;
+    uint64_t start = now_ns();
+    const struct spill_record* records = (const struct spill_record*)(restore_map + 1);
+    size_t total = restore_map->items;
+    int items[MAX_BATCH], priorities[MAX_BATCH];
+    for (size_t at = 0; at < total;) {
+        int n = total - at < MAX_BATCH ? (int)(total - at) : MAX_BATCH;
+        for (int i = 0; i < n; i++) {
+            items[i] = payload_max ? payload_make(records[at + i].item) : records[at + i].item;
+            priorities[i] = records[at + i].priority;
+        }
+        int got = fsem_take(&warehouse->empty, n);
+        if (got) store_products(items, priorities, got, NULL);
+        if (got < n) spill_append(items + got, priorities + got, n - got);
+        at += n;
+    }
+    int supply = atomic_load(&warehouse->supply_count) - (int)(total < INT_MAX ? total : INT_MAX);
+    atomic_store(&warehouse->supply_count, supply > 0 ? supply : 0);
+    restored_items = total;
+    restored_produced = restore_map->produced;
+    restored_consumed = restore_map->consumed;
+    munmap(restore_map, restore_bytes);
+    restore_map = NULL;
+    restore_ms += (now_ns() - start) / 1e6;
+}
+
+// Bulk variant of take_product: waits for at least one item and drains up to
+// max of what is already stocked, levels chosen by the scheduling policy.
+// Returns the number of items taken, or -1 when woken up without an item
+// (e.g. during shutdown).
+int take_products(int* items, int max, int* depth) {
+    if (shm) return shm_take_products(items, max, depth);
+    INSTR_START(instr_start);
+    uint64_t trace_start = trace_begin(TRACE_WAIT_STOCK);
+    int got = fsem_wait_upto(&warehouse->full, max);
+    trace_end(TRACE_WAIT_STOCK, trace_start, got);
+    INSTR_END(INSTR_FULL_WAIT, instr_start);
+    return fetch_products(items, got, depth);
+}
+
+// Take the items behind got "full" credits the caller holds, hand back the
+// slots, and return how many came out (-1 for none)
+int fetch_products(int* items, int got, int* depth) {
+    int taken = 0;
+
+    if (queue_engine == ENGINE_STEAL) {
+        // As with the rings, an item whose credit was posted may still be
+        // on its way into a deque, so coming up short is only transient.
+        while (taken < got) {
+            int n = steal_take(items + taken, got - taken);
+            taken += n;
+            if (n == 0) {
+                if (!simulation_running) break;
+                sched_yield();
+            }
+        }
+        if (depth) *depth = fsem_value(&warehouse->full);
+    } else if (queue_engine == ENGINE_LOCKFREE) {
+        // A producer may have claimed an earlier cell but not published it
+        // yet, so coming up short right after the wait is only transient.
+        while (taken < got) {
+            unsigned mask = atomic_load_explicit(&warehouse->nonempty_levels, memory_order_acquire);
+            while (mask && taken < got) {
+                long quota;
+                int rank = pick_level(mask, &quota);
+                int want = got - taken < quota ? got - taken : (int)quota;
+                int n = ring_pop_n(&level_rings[rank], items + taken, want);
+                if (n == 0) {
+                    level_maybe_empty(rank);
+                    mask &= ~(1u << rank);
+                    continue;
+                }
+                if (schedule_policy == POLICY_WRR) wrr_left -= n - 1; // pick_level counted one
+                taken += n;
+            }
+            if (taken < got) {
+                if (!simulation_running) break;
+                sched_yield();
+            }
+        }
+        if (depth) *depth = normal_stock() + urgent_stock();
+    } else {
+        lock_warehouse();
+        while (taken < got && atomic_load_explicit(&warehouse->nonempty_levels, memory_order_relaxed)) {
+            int item = extract_product();
+            if (item < 0) break;
+            items[taken++] = item;
+        }
+        if (depth) *depth = normal_stock() + urgent_stock();
+        unlock_warehouse();
+    }
+
+    fsem_post_n(&warehouse->full, got - taken);  // units that had no item behind them
+    fsem_post_n(&warehouse->empty, taken);
+    return taken > 0 ? taken : -1;
+}
+
+// Items of the level with the given rank
+int level_stock(int rank) {
+    if (queue_engine == ENGINE_STEAL) {
+        size_t total = 0;
+        for (int i = 0; steal_deques && i < NUM_CONSUMERS; i++) total += deque_count(&steal_deques[i].levels[rank]);
+        return (int)total;
+    }
+    if (queue_engine == ENGINE_LOCKFREE) return (int)ring_count(&level_rings[rank]);
+    // Read out first: it never passes in, so the difference cannot go negative
+    size_t out = atomic_load_explicit(&warehouse->levels[rank].out, memory_order_relaxed);
+    return (int)(atomic_load_explicit(&warehouse->levels[rank].in, memory_order_relaxed) - out);
+}
+
+int normal_stock() {
+    return level_stock(LEVEL_RANK(0));
+}
+
+// Everything above priority 0
+int urgent_stock() {
+    int total = 0;
+    for (int r = 0; r < priority_levels - 1; r++) total += level_stock(r);
+    return total;
+}
+
+// Slot storage comes straight from mmap, so it is page (and thus cache-line)
+// aligned. Large buffers try explicit huge pages first and fall back to
+// transparent huge pages.
+void* alloc_slots(size_t bytes) {
+    void* mem = MAP_FAILED;
+    if (bytes >= HUGE_PAGE_SIZE) {
+        size_t huge_bytes = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        mem = mmap(NULL, huge_bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (mem == MAP_FAILED) {
+        mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            printf("[ERROR] Could not allocate %zu bytes of buffer storage!\n", bytes);
+            exit(1);
+        }
+        if (bytes >= HUGE_PAGE_SIZE)
+            madvise(mem, bytes, MADV_HUGEPAGE);
+    }
+    if (slot_node >= 0) bind_to_node(mem, bytes, slot_node, 0);
+    return mem;
+}
+
+void free_slots(void* mem, size_t bytes) {
+    if (!mem) return;
+    if (bytes >= HUGE_PAGE_SIZE)
+        bytes = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    munmap(mem, bytes);
+}
+
+size_t round_up_pow2(size_t n) {
+    size_t size = 2;
+    while (size < n) size <<= 1;
+    return size;
+}
+
+// Allocate a ring with at least min_size cells, rounded up to a power of two
+void ring_init(struct mpmc_ring* r, size_t min_size) {
+    size_t size = round_up_pow2(min_size);
+
+    r->bytes = size * sizeof(struct ring_cell);
+    r->cells = alloc_slots(r->bytes);
+    for (size_t i = 0; i < size; i++)
+        atomic_store_explicit(&r->cells[i].seq, i, memory_order_relaxed);
+    r->mask = size - 1;
+    atomic_store(&r->enqueue_pos, 0);
+    atomic_store(&r->dequeue_pos, 0);
+}
+
+void ring_destroy(struct mpmc_ring* r) {
+    free_slots(r->cells, r->bytes);
+    r->cells = NULL;
+}
+
+// Returns 0 on success, -1 if the ring is full
+int ring_push(struct mpmc_ring* r, int item, uint64_t stamp) {
+    size_t pos = atomic_load_explicit(&r->enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        struct ring_cell* cell = &r->cells[pos & r->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                cell->item = item;
+                atomic_store_explicit(&cell->stamp, stamp, memory_order_relaxed);
+                atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+                return 0;
+            }
+        } else if (dif < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&r->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+// Returns 1 and stores the item on success, 0 if the ring is (momentarily) empty
+int ring_pop(struct mpmc_ring* r, int* item) {
+    size_t pos = atomic_load_explicit(&r->dequeue_pos, memory_order_relaxed);
+    for (;;) {
+        struct ring_cell* cell = &r->cells[pos & r->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *item = cell->item;
+                atomic_store_explicit(&cell->seq, pos + r->mask + 1, memory_order_release);
+                return 1;
+            }
+        } else if (dif < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&r->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+// Reserve count consecutive cells with a single fetch_add and fill them in
+// order. Callers hold that many "empty" units, so every reserved cell is
+// free or about to be released by the consumer that claimed it.
+void ring_push_n(struct mpmc_ring* r, const int* items, int count, uint64_t stamp) {
+    size_t pos = atomic_fetch_add_explicit(&r->enqueue_pos, count, memory_order_relaxed);
+    for (int i = 0; i < count; i++) {
+        struct ring_cell* cell = &r->cells[(pos + i) & r->mask];
+        while (atomic_load_explicit(&cell->seq, memory_order_acquire) != pos + i)
+            sched_yield();
+        cell->item = items[i];
+        atomic_store_explicit(&cell->stamp, stamp, memory_order_relaxed);
+        atomic_store_explicit(&cell->seq, pos + i + 1, memory_order_release);
+    }
+}
+
+// Claim up to max consecutive published cells with a single CAS.
+// Returns the number of items stored in items (0 if the ring looks empty).
+int ring_pop_n(struct mpmc_ring* r, int* items, int max) {
+    size_t pos = atomic_load_explicit(&r->dequeue_pos, memory_order_relaxed);
+    for (;;) {
+        int ready = 0;
+        while (ready < max &&
+               atomic_load_explicit(&r->cells[(pos + ready) & r->mask].seq, memory_order_acquire) == pos + ready + 1)
+            ready++;
+
+        if (ready == 0) {
+            size_t seq = atomic_load_explicit(&r->cells[pos & r->mask].seq, memory_order_acquire);
+            if ((intptr_t)seq - (intptr_t)(pos + 1) < 0) return 0;
+            pos = atomic_load_explicit(&r->dequeue_pos, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&r->dequeue_pos, &pos, pos + ready,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            for (int i = 0; i < ready; i++) {
+                struct ring_cell* cell = &r->cells[(pos + i) & r->mask];
+                items[i] = cell->item;
+                atomic_store_explicit(&cell->seq, pos + i + r->mask + 1, memory_order_release);
+            }
+            return ready;
+        }
+    }
+}
+
+// Approximate number of items in the ring (exact when no push/pop is in flight)
+size_t ring_count(struct mpmc_ring* r) {
+    size_t head = atomic_load_explicit(&r->dequeue_pos, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->enqueue_pos, memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+const char* engine_name(int engine) {
+    if (engine == ENGINE_STEAL) return "steal";
+    return engine == ENGINE_LOCKFREE ? "lockfree" : "mutex";
+}
+
+// Claim the next free retailer deque for the calling thread
+void steal_attach() {
+    int slot = atomic_fetch_add(&steal_attached, 1);
+    my_retailer = slot < NUM_CONSUMERS ? slot : -1;
+    if (queue_engine != ENGINE_STEAL || my_retailer < 0) return;
+
+    // Deques follow their owner unless --mem-node says otherwise. Suppliers
+    // may already have faulted pages in, so ask the kernel to move them.
+    struct retailer_deques* rd = &steal_deques[my_retailer];
+    my_node = current_node();
+    atomic_store(&rd->node, my_node);
+    if (mem_node == MEM_NODE_FIRST_TOUCH && numa_nodes > 1) {
+        for (int r = 0; r < priority_levels; r++)
+            bind_to_node(rd->levels[r].slots, buffer_capacity * sizeof(struct deque_slot), my_node, MPOL_MF_MOVE);
+    }
+}
+
+// Retailer deque for the next supplier batch
+int steal_route_pick() {
+    if (!route_ready) {
+        route_next = atomic_fetch_add(&steal_route_seed, 1);
+        my_node = current_node();
+        route_ready = 1;
+    }
+    // Prefer retailers on the supplier's own node; the others are only used
+    // when no retailer lives there
+    int local_only = 0;
+    for (int i = 0; numa_nodes > 1 && i < NUM_CONSUMERS && !local_only; i++)
+        local_only = atomic_load_explicit(&steal_deques[i].node, memory_order_relaxed) == my_node;
+
+    if (steal_route == ROUTE_LEAST_LOADED) {
+        int best = 0;
+        size_t best_load = SIZE_MAX;
+        for (int i = 0; i < NUM_CONSUMERS; i++) {
+            if (local_only && atomic_load_explicit(&steal_deques[i].node, memory_order_relaxed) != my_node)
+                continue;
+            if (atomic_load_explicit(&steal_deques[i].parked, memory_order_relaxed)) continue;
+            size_t load = 0;
+            for (int r = 0; r < priority_levels; r++) load += deque_count(&steal_deques[i].levels[r]);
+            if (load < best_load) {
+                best_load = load;
+                best = i;
+            }
+        }
+        return best;
+    }
+    // Round-robin per supplier, each starting at a different retailer
+    for (int tries = 0; tries < NUM_CONSUMERS; tries++) {
+        int i = (int)(route_next++ % (unsigned)NUM_CONSUMERS);
+        if (atomic_load_explicit(&steal_deques[i].parked, memory_order_relaxed)) continue;
+        if (!local_only || atomic_load_explicit(&steal_deques[i].node, memory_order_relaxed) == my_node)
+            return i;
+    }
+    return (int)(route_next % (unsigned)NUM_CONSUMERS);
+}
+
+void deque_push_n(struct steal_deque* d, const int* items, int count, uint64_t stamp) {
+    while (atomic_flag_test_and_set_explicit(&d->push_lock, memory_order_acquire))
+        sched_yield();
+    size_t bottom = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    for (int i = 0; i < count; i++) {
+        struct deque_slot* slot = &d->slots[(bottom + i) & buffer_mask];
+        atomic_store_explicit(&slot->item, items[i], memory_order_relaxed);
+        atomic_store_explicit(&slot->stamp, stamp, memory_order_relaxed);
+    }
+    atomic_store_explicit(&d->bottom, bottom + count, memory_order_release);
+    atomic_flag_clear_explicit(&d->push_lock, memory_order_release);
+}
+
+// Take up to max items from the top. Slots ahead of top cannot be reused
+// before they are taken: every stocked item holds one of only buffer_capacity
+// credits, so a lost CAS merely means someone else got them first.
+// Takers look at their cached copy of bottom first; it is published with
+// release, so items seen through it are as visible as through bottom itself.
+int deque_take_n(struct steal_deque* d, int* items, int max) {
+    size_t top = atomic_load_explicit(&d->top, memory_order_acquire);
+    for (;;) {
+        size_t bottom = atomic_load_explicit(&d->bottom_cached, memory_order_acquire);
+        if (top >= bottom) {
+            bottom = atomic_load_explicit(&d->bottom, memory_order_acquire);
+            if (top >= bottom) return 0;
+            atomic_store_explicit(&d->bottom_cached, bottom, memory_order_release);
+        }
+        int n = bottom - top < (size_t)max ? (int)(bottom - top) : max;
+        for (int i = 0; i < n; i++)
+            items[i] = atomic_load_explicit(&d->slots[(top + i) & buffer_mask].item, memory_order_relaxed);
+        if (atomic_compare_exchange_weak_explicit(&d->top, &top, top + n,
+                                                  memory_order_acq_rel, memory_order_acquire))
+            return n;
+    }
+}
+
+size_t deque_count(struct steal_deque* d) {
+    size_t top = atomic_load_explicit(&d->top, memory_order_relaxed);
+    size_t bottom = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    return bottom > top ? bottom - top : 0;
+}
+
+// Take up to max items, own deques first, then from the other retailers on
+// the same node and only then across nodes. Levels are chosen by the policy
+// within one retailer's deques only.
+int steal_take(int* items, int max) {
+    int start = my_retailer >= 0 ? my_retailer : 0;
+    for (int remote = 0; remote < (numa_nodes > 1 ? 2 : 1); remote++) {
+        for (int k = 0; k < NUM_CONSUMERS; k++) {
+            struct retailer_deques* rd = &steal_deques[(start + k) % NUM_CONSUMERS];
+            int node = atomic_load_explicit(&rd->node, memory_order_relaxed);
+            int same_node = numa_nodes <= 1 || node < 0 || node == my_node;
+            if (same_node == remote) continue;
+            int n = steal_take_from(rd, items, max);
+            if (n == 0) continue;
+            if (k > 0 && my_retailer >= 0) {
+                steal_deques[my_retailer].stolen += n;
+                if (remote) steal_deques[my_retailer].stolen_remote += n;
+            }
+            return n;
+        }
+    }
+    return 0;
+}
+
+int steal_take_from(struct retailer_deques* rd, int* items, int max) {
+    steal_source = rd;
+    unsigned mask = atomic_load_explicit(&rd->nonempty, memory_order_acquire);
+    while (mask) {
+        long quota;
+        int rank = pick_level(mask, &quota);
+        int n = deque_take_n(&rd->levels[rank], items, max < quota ? max : (int)quota);
+        if (n > 0) {
+            if (schedule_policy == POLICY_WRR) wrr_left -= n - 1;
+            return n;
+        }
+        // Clear the bit, then recheck in case a supplier refilled meanwhile
+        atomic_fetch_and_explicit(&rd->nonempty, ~(1u << rank), memory_order_acq_rel);
+        if (deque_count(&rd->levels[rank]) > 0)
+            atomic_fetch_or_explicit(&rd->nonempty, 1u << rank, memory_order_release);
+        mask &= ~(1u << rank);
+    }
+    return 0;
+}
+
+// Read the CPU -> node map from sysfs; machines without it count as one node
+void numa_init() {
+    int cpus[MAX_CPUS];
+    for (int node = 0; node < MAX_NODES; node++) {
+        char path[64], text[1024];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* f = fopen(path, "r");
+        if (!f) continue;
+        int ok = fgets(text, sizeof(text), f) != NULL;
+        fclose(f);
+        text[strcspn(text, "\n")] = '\0';
+        int n = ok && text[0] ? parse_cpu_list(text, cpus, MAX_CPUS) : 0;
+        for (int i = 0; i < n; i++) cpu_to_node[cpus[i]] = node;
+        if (node + 1 > numa_nodes) numa_nodes = node + 1;
+    }
+}
+
+// Parse "0-3,8,10-11"; returns the number of CPUs or -1
+int parse_cpu_list(const char* text, int* cpus, int max_cpus) {
+    int n = 0;
+    const char* p = text;
+    while (*p) {
+        char* end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p) return -1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) return -1;
+        }
+        if (first < 0 || last < first || last >= MAX_CPUS) return -1;
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (n == max_cpus) return -1;
+            cpus[n++] = (int)cpu;
+        }
+        if (*end == ',') end++;
+        else if (*end != '\0') return -1;
+        p = end;
+    }
+    return n > 0 ? n : -1;
+}
+
+int current_node() {
+    int cpu = sched_getcpu();
+    return cpu >= 0 && cpu < MAX_CPUS ? cpu_to_node[cpu] : 0;
+}
+
+// Node for shared queue storage according to --mem-node, or -1 for first touch
+int resolve_mem_node() {
+    if (numa_nodes <= 1) return -1;
+    if (mem_node == MEM_NODE_SUPPLIERS) return supplier_cpu_count ? cpu_to_node[supplier_cpus[0]] : -1;
+    if (mem_node == MEM_NODE_RETAILERS) return retailer_cpu_count ? cpu_to_node[retailer_cpus[0]] : -1;
+    return mem_node;
+}
+
+// Prefer (not require) the given node for a mapping, so a full node still
+// falls back to the others. Failures only cost locality, never correctness.
+void bind_to_node(void* mem, size_t bytes, int node, unsigned flags) {
+    if (node < 0 || node >= MAX_NODES) return;
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long)) + 1] = {0};
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    syscall(SYS_mbind, mem, bytes, MPOL_PREFERRED, mask, sizeof(mask) * 8, flags);
+}
+
+// What spawn_thread hands to thread_start
+struct thread_start {
+    void* (*fn)(void*);
+    void* arg;
+};
+
+// Threads start on shard 0, which need not be the private warehouse the
+// thread-local views point at initially (--shm)
+void* thread_start(void* arg) {
+    struct thread_start start = *(struct thread_start*)arg;
+    free(arg);
+    shard_enter(0);
+    return start.fn(start.arg);
+}
+
+// Create a worker, pinned to cpus[index % cpu_count] when a CPU list was given
+void spawn_thread(pthread_t* thread, const int* cpus, int cpu_count, int index, void* (*fn)(void*), void* arg) {
+    struct thread_start* start = malloc(sizeof(*start));
+    if (!start) {
+        printf("[ERROR] Could not start thread: out of memory\n");
+        exit(1);
+    }
+    start->fn = fn;
+    start->arg = arg;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (cpu_count > 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[index % cpu_count], &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+    int err = pthread_create(thread, &attr, thread_start, start);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        printf("[ERROR] Could not start thread: %s\n", strerror(err));
+        exit(1);
+    }
+}
+
+// Set up semaphores, mutex and buffers for the selected engine and capacity
+void init_warehouse() {
+    buffer_capacity = round_up_pow2(buffer_capacity);
+    buffer_mask = buffer_capacity - 1;
+    atomic_store(&warehouse->nonempty_levels, 0);
+
+    fsem_spin_max = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? FSEM_SPIN_MAX : 0;
+    if (shm_name) {
+        shm_attach();
+        return;
+    }
+    // Records are made by the supplier threads (or the task workers), and by restore_stock
+    if (payload_max) payload_init((task_workers ? task_workers : NUM_PRODUCERS) + (restore_path != NULL));
+    atomic_store(&warehouse->supply_count, atomic_load(&warehouse->simulation_count));
+    slot_node = resolve_mem_node();
+    if (shard_count > 1) shard_ring_init();
+    for (int s = shard_count - 1; s >= 0; s--) { // ends back on shard 0
+        if (s > 0) shard_state[s] = &shard_warehouses[s - 1];
+        shard_enter(s);
+        init_shard();
+    }
+    if (queue_engine == ENGINE_STEAL) {
+        steal_deques = alloc_slots(NUM_CONSUMERS * sizeof(struct retailer_deques));
+        for (int i = 0; i < NUM_CONSUMERS; i++) {
+            atomic_store(&steal_deques[i].node, -1);
+            for (int r = 0; r < priority_levels; r++)
+                steal_deques[i].levels[r].slots = alloc_slots(buffer_capacity * sizeof(struct deque_slot));
+        }
+        atomic_store(&steal_attached, 0);
+    }
+    slot_node = -1;
+}
+
+// Credits, lock and level queues of the shard this thread is on; the steal
+// engine keeps its items in the retailers' deques instead
+void init_shard() {
+    fsem_init(&warehouse->empty, (int)buffer_capacity);
+    fsem_init(&warehouse->full, 0);
+    pthread_mutex_init(&warehouse->mutex, NULL);
+    if (queue_engine == ENGINE_STEAL) return;
+    for (int r = 0; r < priority_levels; r++) {
+        if (queue_engine == ENGINE_LOCKFREE) {
+            ring_init(&level_rings[r], buffer_capacity);
+        } else {
+            level_slots[r] = alloc_slots(buffer_capacity * sizeof(struct level_slot));
+            atomic_store(&warehouse->levels[r].in, 0);
+            atomic_store(&warehouse->levels[r].out, 0);
+            warehouse->levels[r].out_cached = 0;
+            warehouse->levels[r].in_cached = 0;
+        }
+    }
+}
+
+void destroy_warehouse() {
+    if (shm) {
+        shm_detach();
+        return;
+    }
+    if (payload_max) payload_destroy();
+    for (int s = shard_count - 1; s >= 0; s--) {
+        shard_enter(s);
+        destroy_shard();
+    }
+    if (queue_engine == ENGINE_STEAL) {
+        for (int i = 0; i < NUM_CONSUMERS; i++)
+            for (int r = 0; r < priority_levels; r++)
+                free_slots(steal_deques[i].levels[r].slots, buffer_capacity * sizeof(struct deque_slot));
+        free_slots(steal_deques, NUM_CONSUMERS * sizeof(struct retailer_deques));
+        steal_deques = NULL;
+    }
+}
+
+void destroy_shard() {
+    pthread_mutex_destroy(&warehouse->mutex);
+    if (queue_engine == ENGINE_STEAL) return;
+    for (int r = 0; r < priority_levels; r++) {
+        if (queue_engine == ENGINE_LOCKFREE) {
+            ring_destroy(&level_rings[r]);
+        } else {
+            free_slots(level_slots[r], buffer_capacity * sizeof(struct level_slot));
+            level_slots[r] = NULL;
+        }
+    }
+}
+
+// Quick look, before the prompts, whether --shm would join a running warehouse
+// (which already has its count). shm_attach decides for real under the lock.
+int shm_segment_live() {
+    int fd = shm_open(shm_name, O_RDWR, 0);
+    if (fd < 0) return 0;
+    struct stat st;
+    int live = 0;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct shm_header)) {
+        void* mem = mmap(NULL, sizeof(struct shm_header), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mem != MAP_FAILED) {
+            struct shm_header* header = mem;
+            // A foreign magic counts as live: shm_attach refuses it, no count needed
+            unsigned magic = atomic_load(&header->magic);
+            live = magic != 0 && (magic != SHM_MAGIC || shm_live_processes(header) > 0);
+            munmap(mem, sizeof(struct shm_header));
+        }
+    }
+    close(fd);
+    return live;
+}
+
+static size_t shm_slots_offset() {
+    return (sizeof(struct shm_header) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+}
+
+// Join the segment named by --shm, creating it first when it does not exist
+// or only holds the leftovers of processes that are all gone. Attaching
+// processes adopt the creator's capacity and number of levels. The whole
+// step runs under flock so that two processes never both create it.
+void shm_attach() {
+    if (queue_engine != ENGINE_MUTEX) {
+        printf("[ERROR] --shm needs --engine=mutex\n");
+        exit(1);
+    }
+    shm_fd = shm_open(shm_name, O_RDWR | O_CREAT, 0600);
+    if (shm_fd < 0) {
+        printf("[ERROR] Could not open shared memory %s: %s\n", shm_name, strerror(errno));
+        exit(1);
+    }
+    flock(shm_fd, LOCK_EX);
+    futex_private = 0;
+
+    struct stat st;
+    if (fstat(shm_fd, &st) != 0) {
+        printf("[ERROR] Could not stat shared memory %s: %s\n", shm_name, strerror(errno));
+        exit(1);
+    }
+    if ((size_t)st.st_size >= sizeof(struct shm_header)) {
+        shm = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+        if (shm == MAP_FAILED) {
+            printf("[ERROR] Could not map shared memory %s: %s\n", shm_name, strerror(errno));
+            exit(1);
+        }
+        unsigned magic = atomic_load(&shm->magic);
+        if (magic != 0 && magic != SHM_MAGIC) {
+            printf("[ERROR] Shared memory %s was made by an incompatible build (%s layout expected); "
+                   "remove /dev/shm%s if no such process is left\n", shm_name, LAYOUT_NAME, shm_name);
+            exit(1);
+        }
+        if (magic == SHM_MAGIC && shm_live_processes(shm) > 0 && shm->bytes != (size_t)st.st_size) {
+            printf("[ERROR] Shared memory %s is in use but its size does not match its header\n", shm_name);
+            exit(1);
+        }
+        if (magic == 0 || shm_live_processes(shm) == 0) {
+            munmap(shm, st.st_size);
+            shm = NULL;
+        }
+    }
+
+    if (!shm) {
+        if (atomic_load(&private_warehouse.simulation_count) <= 0) {
+            printf("[ERROR] The first process on %s needs --count\n", shm_name);
+            exit(1);
+        }
+        size_t bytes = shm_slots_offset() + (size_t)priority_levels * buffer_capacity * sizeof(struct level_slot);
+        // Truncating to 0 first hands out zeroed pages, also over stale contents
+        if (ftruncate(shm_fd, 0) != 0 || ftruncate(shm_fd, bytes) != 0) {
+            printf("[ERROR] Could not size shared memory %s: %s\n", shm_name, strerror(errno));
+            exit(1);
+        }
+        shm = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+        if (shm == MAP_FAILED) {
+            printf("[ERROR] Could not map shared memory %s: %s\n", shm_name, strerror(errno));
+            exit(1);
+        }
+        struct warehouse_state* state = &shm->state;
+        fsem_init(&state->empty, (int)buffer_capacity);
+        fsem_init(&state->full, 0);
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&state->mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+        atomic_store(&state->simulation_count, atomic_load(&private_warehouse.simulation_count));
+        atomic_store(&state->supply_count, atomic_load(&private_warehouse.simulation_count));
+        shm->capacity = buffer_capacity;
+        shm->levels = priority_levels;
+        shm->bytes = bytes;
+        atomic_store_explicit(&shm->magic, SHM_MAGIC, memory_order_release);
+    }
+
+    buffer_capacity = shm->capacity;
+    buffer_mask = buffer_capacity - 1;
+    priority_levels = shm->levels;
+    // workload_init built the table for this process's own --levels
+    if (priority_dist == DIST_ZIPF) zipf_cdf(priority_zipf_cdf, priority_levels);
+    warehouse = &shm->state;
+    shard_state[0] = warehouse;
+    for (int r = 0; r < priority_levels; r++)
+        level_slots[r] = (struct level_slot*)((char*)shm + shm_slots_offset()) + (size_t)r * buffer_capacity;
+
+    for (int i = 0; i < SHM_MAX_PROCESSES && !shm_me; i++) {
+        int free_entry = 0;
+        if (atomic_compare_exchange_strong(&shm->procs[i].pid, &free_entry, getpid())) {
+            shm_me = &shm->procs[i];
+            shm_me->role = shm_role;
+            shm_me->claimed = 0;
+            shm_me->supplying = 0;
+        }
+    }
+    flock(shm_fd, LOCK_UN);
+    if (!shm_me) {
+        printf("[ERROR] More than %d processes on %s\n", SHM_MAX_PROCESSES, shm_name);
+        exit(1);
+    }
+}
+
+// Leave the segment; the last process out removes it
+void shm_detach() {
+    flock(shm_fd, LOCK_EX);
+    lock_warehouse();
+    atomic_fetch_add(&warehouse->simulation_count, shm_me->claimed);
+    atomic_fetch_add(&warehouse->supply_count, shm_me->supplying);
+    shm_me->claimed = 0;
+    shm_me->supplying = 0;
+    atomic_store(&shm_me->pid, 0);
+    unlock_warehouse();
+    int last = shm_live_processes(shm) == 0;
+    if (last) shm_unlink(shm_name);
+    flock(shm_fd, LOCK_UN);
+    munmap(shm, shm->bytes);
+    close(shm_fd);
+    shm = NULL;
+    shm_me = NULL;
+    warehouse = &private_warehouse;
+    shard_state[0] = warehouse;
+}
+
+// Registered processes that are still running
+int shm_live_processes(struct shm_header* header) {
+    int live = 0;
+    for (int i = 0; i < SHM_MAX_PROCESSES; i++) {
+        pid_t pid = atomic_load(&header->procs[i].pid);
+        if (pid > 0 && (kill(pid, 0) == 0 || errno == EPERM)) live++;
+    }
+    return live;
+}
+
+// Remove processes that died without detaching and return the count and
+// supply tickets they had claimed. They hold no credits: those only change hands under the
+// mutex, and a death in there is repaired by shm_recover.
+void shm_reap() {
+    for (int i = 0; i < SHM_MAX_PROCESSES; i++) {
+        struct shm_process* p = &shm->procs[i];
+        int pid = atomic_load(&p->pid);
+        if (pid <= 0 || pid == getpid() || kill(pid, 0) == 0 || errno != ESRCH) continue;
+        lock_warehouse();
+        if (atomic_compare_exchange_strong(&p->pid, &pid, 0)) {
+            atomic_fetch_add(&warehouse->simulation_count, p->claimed);
+            atomic_fetch_add(&warehouse->supply_count, p->supplying);
+            p->claimed = 0;
+            p->supplying = 0;
+            atomic_fetch_add(&shm->reaped, 1);
+        }
+        unlock_warehouse();
+    }
+}
+
+// The previous mutex owner died inside the critical section. Its update can
+// only be half done on the counters: an item is written before it is counted
+// in, and read before it is counted out, so the level queues are right and the
+// credits and level bits are rebuilt from them.
+void shm_recover() {
+    int stock = 0;
+    unsigned mask = 0;
+    for (int r = 0; r < priority_levels; r++) {
+        int n = level_stock(r);
+        stock += n;
+        if (n) mask |= 1u << r;
+    }
+    atomic_store(&warehouse->nonempty_levels, mask);
+    atomic_store(&warehouse->full.count, stock);
+    atomic_store(&warehouse->empty.count, (int)buffer_capacity - stock);
+    futex(&warehouse->empty.count, FUTEX_WAKE | futex_private, INT_MAX);
+    futex(&warehouse->full.count, FUTEX_WAKE | futex_private, INT_MAX);
+    pthread_mutex_consistent(&warehouse->mutex);
+    atomic_fetch_add(&shm->recoveries, 1);
+}
+
+// put_products for shared-memory mode: the credits are taken under the mutex,
+// in the same step as the slots they pay for and as the supply tickets they
+// use up
+int shm_put_products(const int* items, const int* priorities, int count, int* depth) {
+    int done = 0;
+    while (done < count && atomic_load_explicit(&shutdown_phase, memory_order_relaxed) != SHUTDOWN_STOP) {
+        INSTR_START(instr_start);
+        uint64_t trace_start = trace_begin(TRACE_WAIT_SPACE);
+        fsem_wait_nonzero(&warehouse->empty);
+        trace_end(TRACE_WAIT_SPACE, trace_start, 0);
+        INSTR_END(INSTR_EMPTY_WAIT, instr_start);
+        lock_warehouse();
+        int got = fsem_take(&warehouse->empty, count - done);
+        for (int i = done; i < done + got; i++)
+            add_product(items[i], priorities[i]);
+        shm_me->supplying -= got;
+        if (depth) *depth = normal_stock() + urgent_stock();
+        fsem_post_n(&warehouse->full, got);
+        unlock_warehouse();
+        done += got;
+    }
+    return done;
+}
+
+// take_products for shared-memory mode; items taken are also struck off the
+// claim this process holds on the count
+int shm_take_products(int* items, int max, int* depth) {
+    INSTR_START(instr_start);
+    uint64_t trace_start = trace_begin(TRACE_WAIT_STOCK);
+    fsem_wait_nonzero(&warehouse->full);
+    trace_end(TRACE_WAIT_STOCK, trace_start, 0);
+    INSTR_END(INSTR_FULL_WAIT, instr_start);
+    int taken = 0;
+    lock_warehouse();
+    int got = fsem_take(&warehouse->full, max);
+    while (taken < got) {
+        int item = extract_product();
+        if (item < 0) break;
+        items[taken++] = item;
+    }
+    shm_me->claimed -= taken;
+    if (depth) *depth = normal_stock() + urgent_stock();
+    fsem_post_n(&warehouse->full, got - taken);
+    fsem_post_n(&warehouse->empty, taken);
+    unlock_warehouse();
+    return taken > 0 ? taken : -1;
+}
+
+// Timestamp source for latency measurements
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int hist_index(uint64_t value) {
+    if (value < HIST_SUB_COUNT) return (int)value;
+    int exp = 63 - __builtin_clzll(value);
+    int sub = (int)(value >> (exp - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1);
+    return (exp - HIST_SUB_BITS + 1) * HIST_SUB_COUNT + sub;
+}
+
+// Smallest value that lands in bucket i
+static uint64_t hist_bucket_value(int i) {
+    if (i < HIST_SUB_COUNT) return (uint64_t)i;
+    int exp = i / HIST_SUB_COUNT + HIST_SUB_BITS - 1;
+    uint64_t sub = (uint64_t)(i % HIST_SUB_COUNT);
+    return (1ULL << exp) | (sub << (exp - HIST_SUB_BITS));
+}
+
+void hist_record(struct lat_hist* h, uint64_t value) {
+    h->buckets[hist_index(value)]++;
+    h->count++;
+    h->sum += value;
+    if (value > h->max) h->max = value;
+}
+
+void hist_merge(struct lat_hist* dst, const struct lat_hist* src) {
+    for (int i = 0; i < HIST_BUCKETS; i++) dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+// pct in [0, 100]
+uint64_t hist_percentile(const struct lat_hist* h, double pct) {
+    if (h->count == 0) return 0;
+    uint64_t rank = (uint64_t)(pct / 100.0 * (double)h->count + 0.5);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t value = hist_bucket_value(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+#ifdef WAREHOUSE_INSTRUMENT
+uint64_t instr_now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+// Calibrate TSC ticks against CLOCK_MONOTONIC once, for reporting only
+void instr_init() {
+    uint64_t ns0 = now_ns(), t0 = instr_now();
+    struct timespec pause = {0, 20 * 1000 * 1000};
+    nanosleep(&pause, NULL);
+    uint64_t ns1 = now_ns(), t1 = instr_now();
+    instr_ticks_per_ns = ns1 > ns0 ? (double)(t1 - t0) / (double)(ns1 - ns0) : 1.0;
+}
+
+void instr_record(int site, uint64_t ticks) {
+    if (!my_instr) {
+        my_instr = calloc(1, sizeof(struct instr_thread));
+        if (!my_instr) return;
+        my_instr->next = atomic_load(&instr_threads);
+        while (!atomic_compare_exchange_weak(&instr_threads, &my_instr->next, my_instr));
+    }
+    hist_record(&my_instr->sites[site], ticks);
+}
+#endif
+
+// Merge every thread's histograms and print one line per site
+void instr_report() {
+#ifdef WAREHOUSE_INSTRUMENT
+    static const char* names[INSTR_SITES] = {"wait for space", "wait for stock", "lock wait", "lock hold"};
+    printf("Instrumentation (ns):                 count        p50        p99      p99.9        max   total ms\n");
+    for (int site = 0; site < INSTR_SITES; site++) {
+        struct lat_hist* total = calloc(1, sizeof(struct lat_hist));
+        if (!total) return;
+        for (struct instr_thread* t = atomic_load(&instr_threads); t; t = t->next)
+            hist_merge(total, &t->sites[site]);
+        double scale = 1.0 / instr_ticks_per_ns;
+        printf("  %-30s %10llu %10.0f %10.0f %10.0f %10.0f %10.1f\n", names[site],
+               (unsigned long long)total->count, hist_percentile(total, 50.0) * scale,
+               hist_percentile(total, 99.0) * scale, hist_percentile(total, 99.9) * scale,
+               total->max * scale, total->sum * scale / 1e6);
+        free(total);
+    }
+#endif
+}
+
+// Open the --trace file up front so that a bad path fails before the run
+void trace_init() {
+    if (!trace_path) return;
+    trace_file = fopen(trace_path, "w");
+    if (!trace_file) {
+        printf("[ERROR] Could not open trace file %s: %s\n", trace_path, strerror(errno));
+        exit(1);
+    }
+    trace_origin_ns = now_ns();
+}
+
+// Give the calling thread its span ring, named role and id (the trace's own
+// thread number when id is 0); threads never attached record nothing
+void trace_attach(const char* role, int id) {
+    if (!trace_file) return;
+    struct trace_thread* t = calloc(1, sizeof(struct trace_thread));
+    if (!t) return;
+    t->tid = atomic_fetch_add(&trace_next_tid, 1) + 1;
+    snprintf(t->name, sizeof(t->name), "%s %d", role, id ? id : t->tid);
+    pcg32_seed(&t->rng, workload_seed ^ 0x7472616365ULL, (uint64_t)t->tid);
+    t->next = atomic_load(&trace_threads);
+    while (!atomic_compare_exchange_weak(&trace_threads, &t->next, t));
+    my_trace = t;
+}
+
+// Start a span: its start time, or 0 when it is not sampled. The sampling is
+// decided here so that unsampled spans cost no clock reads.
+static inline uint64_t trace_begin(int kind) {
+    struct trace_thread* t = my_trace;
+    if (!t) return 0;
+    uint64_t n = ++t->seen;
+    if (trace_reservoir) {
+        if (n > (uint64_t)trace_reservoir &&
+            pcg32_bounded(&t->rng, n < UINT32_MAX ? (uint32_t)n : UINT32_MAX) >= (uint32_t)trace_reservoir)
+            return 0;
+    } else if (++t->seen_kind[kind] % trace_sample) {
+        return 0;
+    }
+    return now_ns();
+}
+
+// End a span started by trace_begin
+static inline void trace_end(int kind, uint64_t start, int items) {
+    if (start) trace_record(kind, start, items);
+}
+
+void trace_record(int kind, uint64_t start, int items) {
+    struct trace_thread* t = my_trace;
+    uint64_t dur = now_ns() - start;
+    size_t slot;
+    if (!trace_reservoir) slot = t->kept & (TRACE_RING_SPANS - 1);
+    else if (t->kept < (uint64_t)trace_reservoir) slot = t->kept;
+    else slot = pcg32_bounded(&t->rng, (uint32_t)trace_reservoir); // 1 in K, given it was kept with K/n
+    struct trace_span* span = &t->spans[slot];
+    span->start_ns = start - trace_origin_ns;
+    span->dur_ns = dur > UINT32_MAX ? UINT32_MAX : (uint32_t)dur;
+    span->kind = (uint16_t)kind;
+    span->items = (uint16_t)items;
+    t->kept++;
+}
+
+// Write every thread's spans as complete ("X") events, after the threads are joined
+void trace_write() {
+    if (!trace_file) return;
+    static const char* names[TRACE_KINDS] = {"produce", "put", "wait for space", "take", "wait for stock", "consume"};
+    FILE* f = trace_file;
+    fprintf(f, "{\"displayTimeUnit\": \"ns\", \"otherData\": {\"sampling\": \"%s\", \"n\": %d},\n"
+               "\"traceEvents\": [\n", trace_reservoir ? "reservoir" : "1-in-N",
+            trace_reservoir ? trace_reservoir : trace_sample);
+    fprintf(f, "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"warehouse\"}}",
+            (int)getpid());
+    uint64_t spans = 0;
+    for (struct trace_thread* t = atomic_load(&trace_threads); t; t = t->next) {
+        fprintf(f, ",\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+                   "\"args\": {\"name\": \"%s\"}}", (int)getpid(), t->tid, t->name);
+        uint64_t cap = trace_reservoir ? (uint64_t)trace_reservoir : TRACE_RING_SPANS;
+        uint64_t n = t->kept < cap ? t->kept : cap;
+        for (uint64_t i = 0; i < n; i++) {
+            struct trace_span* span = &t->spans[i];
+            fprintf(f, ",\n  {\"name\": \"%s\", \"cat\": \"warehouse\", \"ph\": \"X\", \"ts\": %.3f, "
+                       "\"dur\": %.3f, \"pid\": %d, \"tid\": %d, \"args\": {\"items\": %u}}",
+                    names[span->kind], span->start_ns / 1e3, span->dur_ns / 1e3, (int)getpid(), t->tid,
+                    (unsigned)span->items);
+        }
+        spans += n;
+    }
+    fprintf(f, "\n]}\n");
+    if (fclose(f) != 0) printf("[ERROR] Could not write trace file %s: %s\n", trace_path, strerror(errno));
+    else printf("Trace: %llu spans written to %s\n", (unsigned long long)spans, trace_path);
+    trace_file = NULL;
+}
+
+// Benchmark producer: same hand-off as supplier, minus the simulated work
+void* bench_supplier(void* arg) {
+    (void)arg;
+    trace_attach("Bench supplier", 0);
+    int items[MAX_BATCH], priorities[MAX_BATCH];
+    long first;
+    while ((first = atomic_fetch_add_explicit(&bench_next_item, bench_batch, memory_order_relaxed)) < bench_items) {
+        int n = bench_items - first < bench_batch ? (int)(bench_items - first) : bench_batch;
+        uint64_t stamp = now_ns();
+        for (int i = 0; i < n; i++) {
+            items[i] = (int)(first + i);
+            priorities[i] = items[i] % priority_levels;
+            bench_stamps[first + i] = stamp;
+            if (payload_max) items[i] = payload_make(items[i]);
+        }
+        uint64_t trace_start = trace_begin(TRACE_PUT);
+        put_products(items, priorities, n, NULL);
+        trace_end(TRACE_PUT, trace_start, n);
+    }
+    return NULL;
+}
+
+// Benchmark consumer: records enqueue-to-dequeue latency of every item
+void* bench_retailer(void* arg) {
+    struct lat_hist* hist = arg;
+    int items[MAX_BATCH];
+    long first;
+    steal_attach();
+    trace_attach("Bench retailer", 0);
+    while ((first = atomic_fetch_add_explicit(&bench_next_take, bench_batch, memory_order_relaxed)) < bench_items) {
+        int claim = bench_items - first < bench_batch ? (int)(bench_items - first) : bench_batch;
+        while (claim > 0) {
+            uint64_t trace_start = trace_begin(TRACE_TAKE);
+            int n = take_products(items, claim, NULL);
+            trace_end(TRACE_TAKE, trace_start, n > 0 ? n : 0);
+            if (n < 0) return NULL;
+            for (int i = 0; payload_max && i < n; i++) items[i] = payload_consume(items[i]);
+            uint64_t now = now_ns();
+            for (int i = 0; i < n; i++)
+                hist_record(hist, now - bench_stamps[items[i]]);
+            claim -= n;
+        }
+    }
+    return NULL;
+}
+
+// Open a user-space hardware counter for this thread and every thread it
+// spawns from now on (inherit), stopped until enabled; -1 when the kernel or
+// the CPU does not offer it (containers, VMs, perf_event_paranoid)
+int perf_counter_open(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    return fd;
+}
+
+// Stop and close a counter from perf_counter_open; returns its value, or -1
+// when it never opened
+long long perf_counter_stop(int fd) {
+    if (fd < 0) return -1;
+    long long value = -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &value, sizeof(value)) != sizeof(value)) value = -1;
+    close(fd);
+    return value;
+}
+
+// Measure one sweep point and print its row; gain is relative to baseline_rate
+// (the first batch size of the same point), or 1 when baseline_rate is 0.
+// Returns the measured items/sec.
+double bench_run_one(int first_row, long capacity, int producers, int consumers, double baseline_rate) {
+    NUM_PRODUCERS = producers;
+    NUM_CONSUMERS = consumers;
+    buffer_capacity = (size_t)capacity;
+    init_warehouse();
+
+    atomic_store(&bench_next_item, 0);
+    atomic_store(&bench_next_take, 0);
+
+    pthread_t prod_threads[producers], cons_threads[consumers];
+    struct lat_hist* hists = calloc(consumers, sizeof(struct lat_hist));
+    struct lat_hist* total = calloc(1, sizeof(struct lat_hist));
+    if (!hists || !total) {
+        printf("[ERROR] Could not allocate latency histograms!\n");
+        exit(1);
+    }
+
+    // Counters must exist before the threads do so that they inherit them
+    int llc_fd = perf_counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    int l1d_fd = perf_counter_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                   (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    if (llc_fd >= 0) ioctl(llc_fd, PERF_EVENT_IOC_ENABLE, 0);
+    if (l1d_fd >= 0) ioctl(l1d_fd, PERF_EVENT_IOC_ENABLE, 0);
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < consumers; i++)
+        spawn_thread(&cons_threads[i], retailer_cpus, retailer_cpu_count, i, bench_retailer, &hists[i]);
+    for (int i = 0; i < producers; i++)
+        spawn_thread(&prod_threads[i], supplier_cpus, supplier_cpu_count, i, bench_supplier, NULL);
+    for (int i = 0; i < producers; i++)
+        pthread_join(prod_threads[i], NULL);
+    for (int i = 0; i < consumers; i++)
+        pthread_join(cons_threads[i], NULL);
+    double seconds = (double)(now_ns() - start) / 1e9;
+    long long llc_misses = perf_counter_stop(llc_fd), l1d_misses = perf_counter_stop(l1d_fd);
+
+    for (int i = 0; i < consumers; i++) hist_merge(total, &hists[i]);
+    const char* engine = engine_name(queue_engine);
+    const char* payload = !payload_max ? "none" : payload_alloc == PAYLOAD_MALLOC ? "malloc" : "arena";
+    double rate = (double)total->count / seconds;
+    double gain = baseline_rate > 0 ? rate / baseline_rate : 1.0;
+    char llc[32] = "na", l1d[32] = "na";
+    if (llc_misses >= 0 && total->count) snprintf(llc, sizeof(llc), "%.3f", (double)llc_misses / total->count);
+    if (l1d_misses >= 0 && total->count) snprintf(l1d, sizeof(l1d), "%.3f", (double)l1d_misses / total->count);
+    if (bench_json) {
+        if (llc_misses < 0) strcpy(llc, "null");
+        if (l1d_misses < 0) strcpy(l1d, "null");
+        printf("%s  {\"engine\": \"%s\", \"producers\": %d, \"consumers\": %d, \"capacity\": %zu, "
+               "\"batch\": %d, \"items\": %llu, \"seconds\": %.6f, \"items_per_sec\": %.0f, "
+               "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"batch_gain\": %.2f, \"payload\": \"%s\", "
+               "\"cache_misses_per_item\": %s, \"l1d_misses_per_item\": %s, \"layout\": \"%s\"}",
+               first_row ? "" : ",\n", engine, producers, consumers, buffer_capacity, bench_batch,
+               (unsigned long long)total->count, seconds, rate,
+               (unsigned long long)hist_percentile(total, 50.0),
+               (unsigned long long)hist_percentile(total, 99.0),
+               (unsigned long long)hist_percentile(total, 99.9), gain, payload, llc, l1d, LAYOUT_NAME);
+    } else {
+        printf("%s,%d,%d,%zu,%d,%llu,%.6f,%.0f,%llu,%llu,%llu,%.2f,%s,%s,%s,%s\n",
+               engine, producers, consumers, buffer_capacity, bench_batch,
+               (unsigned long long)total->count, seconds, rate,
+               (unsigned long long)hist_percentile(total, 50.0),
+               (unsigned long long)hist_percentile(total, 99.0),
+               (unsigned long long)hist_percentile(total, 99.9), gain, payload, llc, l1d, LAYOUT_NAME);
+    }
+    fflush(stdout);
+
+    free(hists);
+    free(total);
+    destroy_warehouse();
+    return rate;
+}
+
+// Sweep engines x capacities x producers x consumers x batch sizes and print one row per point
+void run_benchmark() {
+    bench_stamps = malloc(bench_items * sizeof(uint64_t));
+    if (!bench_stamps) {
+        printf("[ERROR] Could not allocate benchmark timestamps!\n");
+        exit(1);
+    }
+
+    if (bench_json)
+        printf("[\n");
+    else
+        printf("engine,producers,consumers,capacity,batch,items,seconds,items_per_sec,p50_ns,p99_ns,p999_ns,batch_gain,"
+               "payload,cache_misses_per_item,l1d_misses_per_item,layout\n");
+
+    int first_row = 1;
+    int alloc_points = payload_max ? bench_alloc_points : 1;
+    for (int e = 0; e < bench_engine_points * alloc_points; e++) {
+        queue_engine = bench_engines[e / alloc_points];
+        payload_alloc = bench_allocs[e % alloc_points];
+        for (int c = 0; c < bench_capacity_points; c++)
+            for (int p = 0; p < bench_producer_points; p++)
+                for (int r = 0; r < bench_consumer_points; r++) {
+                    double baseline = 0;
+                    for (int b = 0; b < bench_batch_points; b++) {
+                        bench_batch = (int)bench_batches[b];
+                        double rate = bench_run_one(first_row, bench_capacities[c], bench_producers[p],
+                                                    bench_consumers[r], baseline);
+                        if (b == 0) baseline = rate;
+                        first_row = 0;
+                    }
+                }
+    }
+
+    if (bench_json)
+        printf("\n]\n");
+    free(bench_stamps);
+}
+
+// Stress producer: random-sized batches of distinct items at random levels until told to stop
+void* stress_supplier(void* arg) {
+    struct stress_tally* tally = arg;
+    struct pcg32 rng;
+    pcg32_seed(&rng, workload_seed, atomic_fetch_add(&stress_streams, 1));
+    int items[MAX_BATCH], priorities[MAX_BATCH];
+    while (!atomic_load_explicit(&stress_stop, memory_order_relaxed)) {
+        int n = 1 + (int)pcg32_bounded(&rng, supplier_batch);
+        for (int i = 0; i < n; i++) {
+            items[i] = (int)(pcg32_next(&rng) & 0x3FFFFFFF);
+            priorities[i] = (int)pcg32_bounded(&rng, priority_levels);
+            tally->sum += (uint64_t)items[i];
+            if (payload_max) items[i] = payload_make(items[i]);
+        }
+        put_products(items, priorities, n, NULL);
+        tally->count += n;
+    }
+    return NULL;
+}
+
+// Stress consumer: takes whatever it gets until woken up empty-handed after the stop
+void* stress_retailer(void* arg) {
+    struct stress_tally* tally = arg;
+    int items[MAX_BATCH];
+    steal_attach();
+    for (;;) {
+        int n = take_products(items, retailer_batch, NULL);
+        if (n < 0) {
+            if (atomic_load(&stress_stop)) break;
+            continue;
+        }
+        for (int i = 0; payload_max && i < n; i++) items[i] = payload_consume(items[i]);
+        for (int i = 0; i < n; i++) tally->sum += (uint64_t)items[i];
+        tally->count += n;
+    }
+    return NULL;
+}
+
+// Run one stress point and print its row; returns 0 when every item is accounted for
+int stress_run_one(int producers, int consumers) {
+    NUM_PRODUCERS = producers;
+    NUM_CONSUMERS = consumers;
+    init_warehouse();
+    simulation_running = 1;
+    atomic_store(&stress_stop, 0);
+
+    pthread_t prod_threads[producers], cons_threads[consumers];
+    struct stress_tally* made = calloc(producers, sizeof(struct stress_tally));
+    struct stress_tally* used = calloc(consumers, sizeof(struct stress_tally));
+    if (!made || !used) {
+        printf("[ERROR] Could not allocate stress tallies!\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < consumers; i++)
+        spawn_thread(&cons_threads[i], retailer_cpus, retailer_cpu_count, i, stress_retailer, &used[i]);
+    for (int i = 0; i < producers; i++)
+        spawn_thread(&prod_threads[i], supplier_cpus, supplier_cpu_count, i, stress_supplier, &made[i]);
+    usleep(stress_seconds * 1000000);
+
+    // Producers first (consumers keep draining so none stays blocked), then
+    // wake every consumer once without an item so it sees the stop
+    atomic_store(&stress_stop, 1);
+    for (int i = 0; i < producers; i++)
+        pthread_join(prod_threads[i], NULL);
+    simulation_running = 0;
+    fsem_post_n(&warehouse->full, consumers);
+    for (int i = 0; i < consumers; i++)
+        pthread_join(cons_threads[i], NULL);
+
+    uint64_t produced = 0, produced_sum = 0, consumed = 0, consumed_sum = 0;
+    for (int i = 0; i < producers; i++) {
+        produced += made[i].count;
+        produced_sum += made[i].sum;
+    }
+    for (int i = 0; i < consumers; i++) {
+        consumed += used[i].count;
+        consumed_sum += used[i].sum;
+    }
+
+    // Whatever is left must still be in the queues and backed by "full" credits
+    int residual = normal_stock() + urgent_stock();
+    int empty_credits = fsem_value(&warehouse->empty), full_credits = fsem_value(&warehouse->full);
+    uint64_t residual_sum = 0;
+    int drained = 0;
+    while (drained < residual) {
+        int items[MAX_BATCH];
+        int n = take_products(items, residual - drained < MAX_BATCH ? residual - drained : MAX_BATCH, NULL);
+        if (n < 0) break;
+        for (int i = 0; payload_max && i < n; i++) items[i] = payload_consume(items[i]);
+        for (int i = 0; i < n; i++) residual_sum += (uint64_t)items[i];
+        drained += n;
+    }
+
+    int ok = produced == consumed + (uint64_t)residual && drained == residual &&
+             produced_sum == consumed_sum + residual_sum &&
+             empty_credits == (int)buffer_capacity - residual && full_credits == residual + consumers;
+    printf("%s,%d,%d,%zu,%d,%llu,%llu,%d,%d,%d,%s\n",
+           engine_name(queue_engine), producers, consumers, buffer_capacity,
+           priority_levels, (unsigned long long)produced, (unsigned long long)consumed, residual,
+           empty_credits, full_credits, ok ? "PASS" : "FAIL");
+    fflush(stdout);
+
+    free(made);
+    free(used);
+    destroy_warehouse();
+    simulation_running = 1;
+    return ok ? 0 : -1;
+}
+
+// Sweep engines x producer x consumer counts; returns the number of failed points
+int run_stress() {
+    int failed = 0;
+    printf("engine,producers,consumers,capacity,levels,produced,consumed,residual,empty_credits,full_credits,result\n");
+    for (int e = 0; e < bench_engine_points; e++) {
+        queue_engine = bench_engines[e];
+        for (int p = 0; p < stress_thread_points; p++)
+            for (int c = 0; c < stress_thread_points; c++)
+                if (stress_run_one(stress_threads[p], stress_threads[c]) != 0) failed++;
+    }
+    instr_report();
+    return failed;
+}
+
+// Map a replay input; binary segments are told apart by their magic
+int replay_open(struct replay_source* src, const char* path) {
+    memset(src, 0, sizeof(*src));
+    src->path = path;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        printf("[ERROR] Could not open %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    src->bytes = (size_t)st.st_size;
+    if (src->bytes == 0) {
+        close(fd);
+        return 0;
+    }
+    src->mem = mmap(NULL, src->bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (src->mem == MAP_FAILED) {
+        printf("[ERROR] Could not map %s: %s\n", path, strerror(errno));
+        src->mem = NULL;
+        return -1;
+    }
+    madvise(src->mem, src->bytes, MADV_SEQUENTIAL);
+
+    const struct segment_header* header = (const struct segment_header*)src->mem;
+    if (src->bytes >= sizeof(struct segment_header) &&
+        memcmp(header->magic, SEGMENT_MAGIC, sizeof(header->magic)) == 0) {
+        if (header->version != SEGMENT_VERSION || header->record_size != sizeof(struct log_record)) {
+            printf("[ERROR] %s is an event segment of another version\n", path);
+            return -1;
+        }
+        uint64_t fits = (src->bytes - sizeof(struct segment_header)) / sizeof(struct log_record);
+        src->binary = 1;
+        src->records = (const struct log_record*)(header + 1);
+        src->count = atomic_load(&((struct segment_header*)src->mem)->record_count);
+        if (src->count > fits) src->count = fits;
+        src->offset_ns = header->clock_offset_ns;
+    }
+    return 0;
+}
+
+static int replay_digits(const char* p, int n) {
+    int value = 0;
+    for (int i = 0; i < n; i++) value = value * 10 + (p[i] - '0');
+    return value;
+}
+
+// Parse one warehouse.log line (classic or precise). The layout is fixed up
+// to the thread id, so most fields are read at known offsets; the stamp's
+// seconds are only converted when they differ from the previous line's.
+static int replay_parse_line(struct replay_source* src, const char* p, const char* end, struct replay_event* ev) {
+    if (end - p < 40 || p[0] != '[' || p[5] != '-' || p[14] != ':') return 0;
+    if (memcmp(p + 1, src->stamp, sizeof(src->stamp)) != 0) {
+        struct tm t;
+        memset(&t, 0, sizeof(t));
+        t.tm_year = replay_digits(p + 1, 4) - 1900;
+        t.tm_mon = replay_digits(p + 6, 2) - 1;
+        t.tm_mday = replay_digits(p + 9, 2);
+        t.tm_hour = replay_digits(p + 12, 2);
+        t.tm_min = replay_digits(p + 15, 2);
+        t.tm_sec = replay_digits(p + 18, 2);
+        t.tm_isdst = -1;
+        src->stamp_sec = mktime(&t);
+        memcpy(src->stamp, p + 1, sizeof(src->stamp));
+    }
+    uint64_t ns = (uint64_t)src->stamp_sec * 1000000000ULL;
+    const char* q = p + 20;
+    if (*q == '.') {
+        ns += (uint64_t)replay_digits(q + 1, 6) * 1000;
+        q += 7;
+    }
+    if (end - q < 28 || memcmp(q, "] [LOG] ", 8) != 0) return 0;
+    q += 8;
+    if (memcmp(q, "Produced: Thread ", 17) == 0) ev->event = EVENT_PRODUCED;
+    else if (memcmp(q, "Consumed: Thread ", 17) == 0) ev->event = EVENT_CONSUMED;
+    else return 0;
+    q += 17;
+    while (q < end && *q != ' ') q++;          // thread id
+    ev->priority = 0;
+    if (end - q > 10 && memcmp(q, " (PRIORITY", 10) == 0) {
+        q += 10;
+        ev->priority = *q == ' ' ? (uint8_t)atoi(q + 1) : 1;
+    }
+    const char* item = memchr(q, 'm', end - q); // the 'm' of "item"
+    if (!item || end - item < 3 || item[1] != ' ') return 0;
+    ev->item = atoi(item + 2);
+    ev->wall_ns = ns;
+    ev->depth = 0;
+    return 1;
+}
+
+// Next events of a source, up to max; 0 once it is used up. Text is cut into
+// lines with memchr, which libc scans a vector at a time.
+int replay_read(struct replay_source* src, struct replay_event* out, int max) {
+    int n = 0;
+    if (src->binary) {
+        while (n < max && src->pos < src->count) {
+            const struct log_record* r = &src->records[src->pos++];
+            out[n++] = (struct replay_event){(uint64_t)((int64_t)r->mono_ns + src->offset_ns), r->item, r->depth,
+                                             r->event, r->priority};
+        }
+        return n;
+    }
+    while (n < max && src->pos < src->bytes) {
+        const char* line = src->mem + src->pos;
+        const char* nl = memchr(line, '\n', src->bytes - src->pos);
+        const char* end = nl ? nl : src->mem + src->bytes;
+        src->pos = end - src->mem + 1;
+        if (replay_parse_line(src, line, end, &out[n])) n++;
+        else if (end > line) src->skipped++;
+    }
+    return n;
+}
+
+// Feed the files through a warehouse of the configured engine and capacity
+// and write the two depth curves, one row per replay_bucket_ms of log time
+int run_replay(int count, char** paths) {
+    NUM_PRODUCERS = 1;
+    NUM_CONSUMERS = 1;
+    init_warehouse();
+    steal_attach();
+    FILE* csv = fopen(replay_csv_path, "w");
+    if (!csv) {
+        printf("[ERROR] Could not create %s: %s\n", replay_csv_path, strerror(errno));
+        return 1;
+    }
+    fprintf(csv, "t_ms,events,original_depth,replay_depth,original_max,replay_max\n");
+
+    struct replay_event* batch = malloc(REPLAY_BATCH * sizeof(struct replay_event));
+    struct spill_record* waiting = NULL;       // produces held back by a full warehouse, oldest first
+    size_t waiting_head = 0, waiting_count = 0, waiting_size = 0;
+    if (!batch) {
+        printf("[ERROR] Could not allocate the replay batch!\n");
+        exit(1);
+    }
+    uint64_t events = 0, produced = 0, consumed = 0, deferred = 0, early = 0, clamped = 0, skipped = 0;
+    uint64_t early_pending = 0, bytes = 0, parse_ns = 0, origin_ns = 0, sum_diff = 0;
+    long long original = 0;                    // depth implied by the text log
+    long long bucket = -1, bucket_events = 0;
+    long long original_depth = 0, original_max = 0, replay_max = 0, max_diff = 0;
+    int replay_depth = 0, status = 0, files = 0;
+    uint64_t start = now_ns();
+
+    for (int f = 0; f < count; f++) {
+        struct replay_source src;
+        if (replay_open(&src, paths[f]) != 0) {
+            status = 1;
+            continue;
+        }
+        bytes += src.bytes;
+        files++;
+        for (;;) {
+            uint64_t parse_start = now_ns();
+            int n = replay_read(&src, batch, REPLAY_BATCH);
+            parse_ns += now_ns() - parse_start;
+            if (n == 0) break;
+            for (int i = 0; i < n; i++) {
+                struct replay_event* ev = &batch[i];
+                if (events == 0) origin_ns = ev->wall_ns;
+                long long t_ms = ev->wall_ns > origin_ns ? (long long)((ev->wall_ns - origin_ns) / 1000000) : 0;
+                if (replay_speed > 0) {
+                    double wait_ms = t_ms / replay_speed - (now_ns() - start) / 1e6;
+                    if (wait_ms >= 0.05) sleep_ms(wait_ms);
+                }
+
+                int priority = ev->priority;
+                if (priority >= priority_levels) {
+                    priority = priority_levels - 1;
+                    clamped++;
+                }
+                if (ev->event == EVENT_PRODUCED) {
+                    produced++;
+                    original++;
+                    int item = payload_max ? payload_make(ev->item) : ev->item;
+                    if (early_pending) {
+                        early_pending--;  // its consume was logged first
+                        if (payload_max) payload_consume(item);
+                    } else if (fsem_take(&warehouse->empty, 1)) {
+                        store_products(&item, &priority, 1, NULL);
+                    } else {
+                        if (waiting_count == waiting_size) {
+                            size_t size = waiting_size ? waiting_size * 2 : 1024;
+                            struct spill_record* grown = malloc(size * sizeof(struct spill_record));
+                            if (!grown) {
+                                printf("[ERROR] Could not allocate the replay backlog!\n");
+                                exit(1);
+                            }
+                            for (size_t k = 0; k < waiting_count; k++)
+                                grown[k] = waiting[(waiting_head + k) % waiting_size];
+                            free(waiting);
+                            waiting = grown;
+                            waiting_size = size;
+                            waiting_head = 0;
+                        }
+                        waiting[(waiting_head + waiting_count++) % waiting_size] = (struct spill_record){item, priority};
+                        deferred++;
+                    }
+                } else {
+                    consumed++;
+                    original--;
+                    int item;
+                    if (fsem_value(&warehouse->full) > 0 && take_products(&item, 1, NULL) == 1) {
+                        if (payload_max) payload_consume(item);
+                        if (waiting_count && fsem_take(&warehouse->empty, 1)) {
+                            struct spill_record next = waiting[waiting_head];
+                            waiting_head = (waiting_head + 1) % waiting_size;
+                            waiting_count--;
+                            store_products(&next.item, &next.priority, 1, NULL);
+                        }
+                    } else {
+                        early_pending++;
+                        early++;
+                    }
+                }
+
+                // A row holds the depths at the end of its bucket
+                if (t_ms / replay_bucket_ms != bucket) {
+                    if (bucket >= 0)
+                        fprintf(csv, "%lld,%lld,%lld,%d,%lld,%lld\n", bucket * replay_bucket_ms, bucket_events,
+                                original_depth, replay_depth, original_max, replay_max);
+                    bucket = t_ms / replay_bucket_ms;
+                    bucket_events = 0;
+                    original_max = replay_max = 0;
+                }
+                original_depth = src.binary ? (long long)ev->depth : (original > 0 ? original : 0);
+                replay_depth = fsem_value(&warehouse->full);
+                long long diff = original_depth > replay_depth ? original_depth - replay_depth
+                                                               : replay_depth - original_depth;
+                sum_diff += diff;
+                if (diff > max_diff) max_diff = diff;
+                bucket_events++;
+                if (original_depth > original_max) original_max = original_depth;
+                if (replay_depth > replay_max) replay_max = replay_depth;
+                events++;
+            }
+        }
+        skipped += src.skipped;
+        if (src.mem) munmap(src.mem, src.bytes);
+    }
+    if (bucket >= 0)
+        fprintf(csv, "%lld,%lld,%lld,%d,%lld,%lld\n", bucket * replay_bucket_ms, bucket_events, original_depth,
+                replay_depth, original_max, replay_max);
+    fclose(csv);
+
+    double seconds = (now_ns() - start) / 1e9;
+    printf("Replayed %llu events (%llu produced, %llu consumed) from %d files in %.3f s (%s)\n",
+           (unsigned long long)events, (unsigned long long)produced, (unsigned long long)consumed, files, seconds,
+           replay_speed > 0 ? "recorded timing" : "as fast as possible");
+    printf("Parsed %.1f MB in %.3f s (%.0f MB/s), %llu lines skipped, %llu priorities clamped to --levels\n",
+           bytes / 1e6, parse_ns / 1e9, parse_ns ? bytes / 1e6 / (parse_ns / 1e9) : 0.0,
+           (unsigned long long)skipped, (unsigned long long)clamped);
+    printf("Engine %s, capacity %zu: %llu produces waited for space, %llu consumes came before their item\n",
+           engine_name(queue_engine), buffer_capacity, (unsigned long long)deferred, (unsigned long long)early);
+    printf("Depth difference (replay vs original): max %lld, mean %.2f; curves written to %s\n", max_diff,
+           events ? (double)sum_diff / events : 0.0, replay_csv_path);
+
+    free(waiting);
+    free(batch);
+    destroy_warehouse();
+    return status;
+}
+
+// Parse a positive int option value, exiting with a message naming it on error
+int parse_positive(const char* text, const char* what) {
+    unsigned long long value;
+    if (parse_count(text, &value) != 0 || value > INT32_MAX) {
+        printf("Invalid %s '%s' (expected a positive integer)\n", what, text);
+        exit(1);
+    }
+    return (int)value;
+}
+
+// With --config FILE, return argv with the file's settings inserted right
+// after argv[0], so that command-line options override the file. Each line is
+// "option = value" or a bare "option" using the long option names; '#' starts
+// a comment. The strings live until exit, as getopt hands out pointers into them.
+char** merge_config_args(int* argc, char* argv[]) {
+    const char* path = NULL;
+    for (int i = 1; i < *argc; i++) {
+        if (strncmp(argv[i], "--config=", 9) == 0) path = argv[i] + 9;
+        else if (strcmp(argv[i], "--config") == 0 && i + 1 < *argc) path = argv[i + 1];
+    }
+    if (!path) return argv;
+
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        printf("[ERROR] Could not open config file %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    int cap = *argc + 16, n = 1;
+    char** merged = malloc(cap * sizeof(char*));
+    merged[0] = argv[0];
+
+    char line[512];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        char* key = line + strspn(line, " \t");
+        if (*key == '\0') continue;
+        char* value = strchr(key, '=');
+        if (value) *value++ = '\0';
+
+        // Trim the key (and value) and drop any leading dashes from the key
+        for (char* end = key + strlen(key); end > key && (end[-1] == ' ' || end[-1] == '\t');) *--end = '\0';
+        while (*key == '-') key++;
+        if (value) {
+            value += strspn(value, " \t");
+            for (char* end = value + strlen(value); end > value && (end[-1] == ' ' || end[-1] == '\t');) *--end = '\0';
+        }
+        if (*key == '\0' || strcmp(key, "config") == 0) {
+            printf("[ERROR] %s:%d: expected \"option = value\"\n", path, lineno);
+            exit(1);
+        }
+
+        size_t len = strlen(key) + (value ? strlen(value) + 1 : 0) + 3;
+        char* arg = malloc(len);
+        if (value) snprintf(arg, len, "--%s=%s", key, value);
+        else snprintf(arg, len, "--%s", key);
+        if (n + *argc >= cap) merged = realloc(merged, (cap *= 2) * sizeof(char*));
+        merged[n++] = arg;
+    }
+    fclose(f);
+
+    for (int i = 1; i < *argc; i++) merged[n++] = argv[i];
+    merged[n] = NULL;
+    *argc = n;
+    return merged;
+}
+
+// Parse a positive count with an optional k/m suffix; returns 0 on success
+int parse_count(const char* text, unsigned long long* value) {
+    char* end;
+    *value = strtoull(text, &end, 10);
+    if (end == text) return -1;
+    if (*end == 'k' || *end == 'K') { *value <<= 10; end++; }
+    else if (*end == 'm' || *end == 'M') { *value <<= 20; end++; }
+    return (*end == '\0' && *value > 0) ? 0 : -1;
+}
+
+// Parse a comma-separated list of counts; returns the number of values or -1
+int parse_list(const char* text, long* values, int max_values) {
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", text);
+
+    int n = 0;
+    for (char* save = NULL, *tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        unsigned long long value;
+        if (n == max_values || parse_count(tok, &value) != 0 || value > (1ULL << 30)) return -1;
+        values[n++] = (long)value;
+    }
+    return n > 0 ? n : -1;
+}
+
+// Options without a short form
+enum {
+    OPT_BENCH = 256,
+    OPT_BENCH_PRODUCERS,
+    OPT_BENCH_CONSUMERS,
+    OPT_BENCH_CAPACITIES,
+    OPT_BENCH_ENGINES,
+    OPT_BENCH_ITEMS,
+    OPT_BENCH_FORMAT,
+    OPT_LOG_FORMAT,
+    OPT_LOG_FSYNC_MS,
+    OPT_LOG_FSYNC_BYTES,
+    OPT_UI_HZ,
+    OPT_SEGMENT_SIZE,
+    OPT_READ_EVENTS,
+    OPT_READ_FORMAT,
+    OPT_SUPPLIER_BATCH,
+    OPT_RETAILER_BATCH,
+    OPT_BENCH_BATCH,
+    OPT_LEVELS,
+    OPT_POLICY,
+    OPT_WRR_WEIGHTS,
+    OPT_DEADLINE_MS,
+    OPT_STRESS,
+    OPT_STRESS_SECONDS,
+    OPT_STRESS_THREADS,
+    OPT_STEAL_ROUTE,
+    OPT_SUPPLIER_CPUS,
+    OPT_RETAILER_CPUS,
+    OPT_MEM_NODE,
+    OPT_SUPPLIERS,
+    OPT_RETAILERS,
+    OPT_COUNT,
+    OPT_LOG,
+    OPT_NO_UI,
+    OPT_CONFIG,
+    OPT_METRICS_PORT,
+    OPT_METRICS_ADDR,
+    OPT_SEED,
+    OPT_ARRIVAL,
+    OPT_ARRIVAL_MS,
+    OPT_BURST_MS,
+    OPT_ITEM_DIST,
+    OPT_ITEM_RANGE,
+    OPT_PRIORITY_DIST,
+    OPT_ZIPF_S,
+    OPT_ON_SIGNAL,
+    OPT_DRAIN_TIMEOUT,
+    OPT_SHM,
+    OPT_ROLE,
+    OPT_PAYLOAD,
+    OPT_PAYLOAD_ALLOC,
+    OPT_BENCH_ALLOC,
+    OPT_TRACE,
+    OPT_TRACE_SAMPLE,
+    OPT_TRACE_RESERVOIR,
+    OPT_TASKS,
+    OPT_SHARDS,
+    OPT_AUTOSCALE,
+    OPT_AUTOSCALE_MS,
+    OPT_AUTOSCALE_HOLD,
+    OPT_AUTOSCALE_LATENCY_MS,
+    OPT_OVERFLOW,
+    OPT_OVERFLOW_TIMEOUT_MS,
+    OPT_SPILL_PATH,
+    OPT_SPILL_SEGMENT_SIZE,
+    OPT_SNAPSHOT,
+    OPT_SNAPSHOT_MS,
+    OPT_RESTORE,
+    OPT_REPLAY,
+    OPT_REPLAY_SPEED,
+    OPT_REPLAY_BUCKET_MS,
+    OPT_REPLAY_CSV
+};
+
+void parse_args(int argc, char* argv[]) {
+    static struct option long_options[] = {
+        {"engine",           required_argument, NULL, 'e'},
+        {"capacity",         required_argument, NULL, 'c'},
+        {"bench",            no_argument,       NULL, OPT_BENCH},
+        {"bench-producers",  required_argument, NULL, OPT_BENCH_PRODUCERS},
+        {"bench-consumers",  required_argument, NULL, OPT_BENCH_CONSUMERS},
+        {"bench-capacities", required_argument, NULL, OPT_BENCH_CAPACITIES},
+        {"bench-engines",    required_argument, NULL, OPT_BENCH_ENGINES},
+        {"bench-items",      required_argument, NULL, OPT_BENCH_ITEMS},
+        {"bench-format",     required_argument, NULL, OPT_BENCH_FORMAT},
+        {"log-format",       required_argument, NULL, OPT_LOG_FORMAT},
+        {"log-fsync-ms",     required_argument, NULL, OPT_LOG_FSYNC_MS},
+        {"log-fsync-bytes",  required_argument, NULL, OPT_LOG_FSYNC_BYTES},
+        {"ui-hz",            required_argument, NULL, OPT_UI_HZ},
+        {"segment-size",     required_argument, NULL, OPT_SEGMENT_SIZE},
+        {"read-events",      no_argument,       NULL, OPT_READ_EVENTS},
+        {"read-format",      required_argument, NULL, OPT_READ_FORMAT},
+        {"supplier-batch",   required_argument, NULL, OPT_SUPPLIER_BATCH},
+        {"retailer-batch",   required_argument, NULL, OPT_RETAILER_BATCH},
+        {"bench-batch",      required_argument, NULL, OPT_BENCH_BATCH},
+        {"levels",           required_argument, NULL, OPT_LEVELS},
+        {"policy",           required_argument, NULL, OPT_POLICY},
+        {"wrr-weights",      required_argument, NULL, OPT_WRR_WEIGHTS},
+        {"deadline-ms",      required_argument, NULL, OPT_DEADLINE_MS},
+        {"stress",           no_argument,       NULL, OPT_STRESS},
+        {"stress-seconds",   required_argument, NULL, OPT_STRESS_SECONDS},
+        {"stress-threads",   required_argument, NULL, OPT_STRESS_THREADS},
+        {"steal-route",      required_argument, NULL, OPT_STEAL_ROUTE},
+        {"supplier-cpus",    required_argument, NULL, OPT_SUPPLIER_CPUS},
+        {"retailer-cpus",    required_argument, NULL, OPT_RETAILER_CPUS},
+        {"mem-node",         required_argument, NULL, OPT_MEM_NODE},
+        {"suppliers",        required_argument, NULL, OPT_SUPPLIERS},
+        {"retailers",        required_argument, NULL, OPT_RETAILERS},
+        {"count",            required_argument, NULL, OPT_COUNT},
+        {"log",              required_argument, NULL, OPT_LOG},
+        {"no-ui",            no_argument,       NULL, OPT_NO_UI},
+        {"config",           required_argument, NULL, OPT_CONFIG},
+        {"metrics-port",     required_argument, NULL, OPT_METRICS_PORT},
+        {"metrics-addr",     required_argument, NULL, OPT_METRICS_ADDR},
+        {"seed",             required_argument, NULL, OPT_SEED},
+        {"arrival",          required_argument, NULL, OPT_ARRIVAL},
+        {"arrival-ms",       required_argument, NULL, OPT_ARRIVAL_MS},
+        {"burst-ms",         required_argument, NULL, OPT_BURST_MS},
+        {"item-dist",        required_argument, NULL, OPT_ITEM_DIST},
+        {"item-range",       required_argument, NULL, OPT_ITEM_RANGE},
+        {"priority-dist",    required_argument, NULL, OPT_PRIORITY_DIST},
+        {"zipf-s",           required_argument, NULL, OPT_ZIPF_S},
+        {"on-signal",        required_argument, NULL, OPT_ON_SIGNAL},
+        {"drain-timeout",    required_argument, NULL, OPT_DRAIN_TIMEOUT},
+        {"shm",              required_argument, NULL, OPT_SHM},
+        {"role",             required_argument, NULL, OPT_ROLE},
+        {"payload",          required_argument, NULL, OPT_PAYLOAD},
+        {"payload-alloc",    required_argument, NULL, OPT_PAYLOAD_ALLOC},
+        {"bench-alloc",      required_argument, NULL, OPT_BENCH_ALLOC},
+        {"trace",            required_argument, NULL, OPT_TRACE},
+        {"trace-sample",     required_argument, NULL, OPT_TRACE_SAMPLE},
+        {"trace-reservoir",  required_argument, NULL, OPT_TRACE_RESERVOIR},
+        {"tasks",            required_argument, NULL, OPT_TASKS},
+        {"shards",           required_argument, NULL, OPT_SHARDS},
+        {"autoscale",        no_argument,       NULL, OPT_AUTOSCALE},
+        {"autoscale-ms",     required_argument, NULL, OPT_AUTOSCALE_MS},
+        {"autoscale-hold",   required_argument, NULL, OPT_AUTOSCALE_HOLD},
+        {"autoscale-latency-ms", required_argument, NULL, OPT_AUTOSCALE_LATENCY_MS},
+        {"overflow",         required_argument, NULL, OPT_OVERFLOW},
+        {"overflow-timeout-ms", required_argument, NULL, OPT_OVERFLOW_TIMEOUT_MS},
+        {"spill-path",       required_argument, NULL, OPT_SPILL_PATH},
+        {"spill-segment-size", required_argument, NULL, OPT_SPILL_SEGMENT_SIZE},
+        {"snapshot",         required_argument, NULL, OPT_SNAPSHOT},
+        {"snapshot-ms",      required_argument, NULL, OPT_SNAPSHOT_MS},
+        {"restore",          required_argument, NULL, OPT_RESTORE},
+        {"replay",           no_argument,       NULL, OPT_REPLAY},
+        {"replay-speed",     required_argument, NULL, OPT_REPLAY_SPEED},
+        {"replay-bucket-ms", required_argument, NULL, OPT_REPLAY_BUCKET_MS},
+        {"replay-csv",       required_argument, NULL, OPT_REPLAY_CSV},
+        {"help",             no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    long list[BENCH_MAX_POINTS];
+    int n;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "e:c:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'e':
+            if (strcmp(optarg, "mutex") == 0) {
+                queue_engine = ENGINE_MUTEX;
+            } else if (strcmp(optarg, "lockfree") == 0) {
+                queue_engine = ENGINE_LOCKFREE;
+            } else if (strcmp(optarg, "steal") == 0) {
+                queue_engine = ENGINE_STEAL;
+            } else {
+                printf("Unknown engine '%s' (expected mutex, lockfree or steal)\n", optarg);
+                exit(1);
+            }
+            // A plain --engine also narrows the benchmark sweep to that engine
+            bench_engines[0] = queue_engine;
+            bench_engine_points = 1;
+            break;
+        case 'c': {
+            unsigned long long value;
+            // The credit counters are ints, so stay well within their range
+            if (parse_count(optarg, &value) != 0 || value > (1ULL << 30)) {
+                printf("Invalid capacity '%s' (expected 1 .. 1073741824 slots)\n", optarg);
+                exit(1);
+            }
+            buffer_capacity = round_up_pow2((size_t)value);
+            break;
+        }
+        case OPT_BENCH:
+            bench_mode = 1;
+            break;
+        case OPT_BENCH_PRODUCERS:
+        case OPT_BENCH_CONSUMERS:
+            if ((n = parse_list(optarg, list, BENCH_MAX_POINTS)) < 0) {
+                printf("Invalid thread count list '%s'\n", optarg);
+                exit(1);
+            }
+            for (int i = 0; i < n; i++) {
+                if (opt == OPT_BENCH_PRODUCERS) bench_producers[i] = (int)list[i];
+                else bench_consumers[i] = (int)list[i];
+            }
+            if (opt == OPT_BENCH_PRODUCERS) bench_producer_points = n;
+            else bench_consumer_points = n;
+            break;
+        case OPT_BENCH_CAPACITIES:
+            if ((bench_capacity_points = parse_list(optarg, bench_capacities, BENCH_MAX_POINTS)) < 0) {
+                printf("Invalid capacity list '%s'\n", optarg);
+                exit(1);
+            }
+            for (int i = 0; i < bench_capacity_points; i++)
+                bench_capacities[i] = (long)round_up_pow2((size_t)bench_capacities[i]);
+            break;
+        case OPT_BENCH_ENGINES: {
+            char copy[64];
+            snprintf(copy, sizeof(copy), "%s", optarg);
+            bench_engine_points = 0;
+            for (char* save = NULL, *tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+                if (bench_engine_points == BENCH_MAX_POINTS) break;
+                if (strcmp(tok, "mutex") == 0) {
+                    bench_engines[bench_engine_points++] = ENGINE_MUTEX;
+                } else if (strcmp(tok, "lockfree") == 0) {
+                    bench_engines[bench_engine_points++] = ENGINE_LOCKFREE;
+                } else if (strcmp(tok, "steal") == 0) {
+                    bench_engines[bench_engine_points++] = ENGINE_STEAL;
+                } else {
+                    printf("Unknown engine '%s' (expected mutex, lockfree or steal)\n", tok);
+                    exit(1);
+                }
+            }
+            break;
+        }
+        case OPT_BENCH_ITEMS: {
+            unsigned long long value;
+            if (parse_count(optarg, &value) != 0 || value > INT32_MAX) {
+                printf("Invalid item count '%s'\n", optarg);
+                exit(1);
+            }
+            bench_items = (long)value;
+            break;
+        }
+        case OPT_BENCH_FORMAT:
+            if (strcmp(optarg, "csv") == 0) {
+                bench_json = 0;
+            } else if (strcmp(optarg, "json") == 0) {
+                bench_json = 1;
+            } else {
+                printf("Unknown benchmark format '%s' (expected csv or json)\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_LOG_FORMAT:
+            if (strcmp(optarg, "classic") == 0) {
+                log_format = LOG_FORMAT_CLASSIC;
+            } else if (strcmp(optarg, "precise") == 0) {
+                log_format = LOG_FORMAT_PRECISE;
+            } else if (strcmp(optarg, "binary") == 0) {
+                log_format = LOG_FORMAT_BINARY;
+            } else {
+                printf("Unknown log format '%s' (expected classic, precise or binary)\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_SEGMENT_SIZE: {
+            unsigned long long value;
+            if (parse_count(optarg, &value) != 0 || value < 4096 || value > (1ULL << 40)) {
+                printf("Invalid segment size '%s' (expected at least 4k)\n", optarg);
+                exit(1);
+            }
+            segment_bytes = (size_t)value;
+            break;
+        }
+        case OPT_READ_EVENTS:
+            read_events_mode = 1;
+            break;
+        case OPT_READ_FORMAT:
+            if (strcmp(optarg, "classic") == 0) {
+                read_format = LOG_FORMAT_CLASSIC;
+            } else if (strcmp(optarg, "precise") == 0) {
+                read_format = LOG_FORMAT_PRECISE;
+            } else if (strcmp(optarg, "csv") == 0) {
+                read_format = LOG_FORMAT_CSV;
+            } else {
+                printf("Unknown read format '%s' (expected classic, precise or csv)\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_LOG_FSYNC_MS:
+        case OPT_LOG_FSYNC_BYTES: {
+            unsigned long long value;
+            if (parse_count(optarg, &value) != 0 || value > (1ULL << 40)) {
+                printf("Invalid fsync threshold '%s'\n", optarg);
+                exit(1);
+            }
+            if (opt == OPT_LOG_FSYNC_MS) log_fsync_ms = (long)value;
+            else log_fsync_bytes = (long)value;
+            break;
+        }
+        case OPT_UI_HZ: {
+            unsigned long long value;
+            if (parse_count(optarg, &value) != 0 || value > 120) {
+                printf("Invalid UI refresh rate '%s' (expected 1 .. 120 Hz)\n", optarg);
+                exit(1);
+            }
+            ui_hz = (int)value;
+            break;
+        }
+        case OPT_SUPPLIER_BATCH:
+        case OPT_RETAILER_BATCH: {
+            unsigned long long value;
+            if (parse_count(optarg, &value) != 0 || value > MAX_BATCH) {
+                printf("Invalid batch size '%s' (expected 1 .. %d)\n", optarg, MAX_BATCH);
+                exit(1);
+            }
+            if (opt == OPT_SUPPLIER_BATCH) supplier_batch = (int)value;
+            else retailer_batch = (int)value;
+            break;
+        }
+        case OPT_BENCH_BATCH:
+            if ((bench_batch_points = parse_list(optarg, bench_batches, BENCH_MAX_POINTS)) < 0) {
+                printf("Invalid batch size list '%s'\n", optarg);
+                exit(1);
+            }
+            for (int i = 0; i < bench_batch_points; i++) {
+                if (bench_batches[i] > MAX_BATCH) {
+                    printf("Invalid batch size %ld (expected 1 .. %d)\n", bench_batches[i], MAX_BATCH);
+                    exit(1);
+                }
+            }
+            break;
+        case OPT_LEVELS: {
+            unsigned long long value;
+            if (parse_count(optarg, &value) != 0 || value < 2 || value > MAX_LEVELS) {
+                printf("Invalid number of priority levels '%s' (expected 2 .. %d)\n", optarg, MAX_LEVELS);
+                exit(1);
+            }
+            priority_levels = (int)value;
+            break;
+        }
+        case OPT_POLICY:
+            if (strcmp(optarg, "strict") == 0) {
+                schedule_policy = POLICY_STRICT;
+            } else if (strcmp(optarg, "wrr") == 0) {
+                schedule_policy = POLICY_WRR;
+            } else if (strcmp(optarg, "deadline") == 0) {
+                schedule_policy = POLICY_DEADLINE;
+            } else {
+                printf("Unknown policy '%s' (expected strict, wrr or deadline)\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_WRR_WEIGHTS: {
+            long weights[MAX_LEVELS];
+            if ((n = parse_list(optarg, weights, MAX_LEVELS)) < 0) {
+                printf("Invalid weight list '%s'\n", optarg);
+                exit(1);
+            }
+            memset(wrr_weights, 0, sizeof(wrr_weights));
+            memcpy(wrr_weights, weights, n * sizeof(long));
+            break;
+        }
+        case OPT_DEADLINE_MS: {
+            unsigned long long value;
+            if (parse_count(optarg, &value) != 0 || value > 86400000ULL) {
+                printf("Invalid deadline '%s'\n", optarg);
+                exit(1);
+            }
+            deadline_ms = (long)value;
+            break;
+        }
+        case OPT_STRESS:
+            stress_mode = 1;
+            break;
+        case OPT_STRESS_SECONDS: {
+            unsigned long long value;
+            if (parse_count(optarg, &value) != 0 || value > 3600) {
+                printf("Invalid stress duration '%s'\n", optarg);
+                exit(1);
+            }
+            stress_seconds = (long)value;
+            break;
+        }
+        case OPT_STRESS_THREADS:
+            if ((n = parse_list(optarg, list, BENCH_MAX_POINTS)) < 0) {
+                printf("Invalid thread count list '%s'\n", optarg);
+                exit(1);
+            }
+            for (int i = 0; i < n; i++) stress_threads[i] = (int)list[i];
+            stress_thread_points = n;
+            break;
+        case OPT_STEAL_ROUTE:
+            if (strcmp(optarg, "rr") == 0) {
+                steal_route = ROUTE_ROUND_ROBIN;
+            } else if (strcmp(optarg, "least") == 0) {
+                steal_route = ROUTE_LEAST_LOADED;
+            } else {
+                printf("Unknown route '%s' (expected rr or least)\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_SUPPLIER_CPUS:
+        case OPT_RETAILER_CPUS: {
+            int* cpus = opt == OPT_SUPPLIER_CPUS ? supplier_cpus : retailer_cpus;
+            int count = parse_cpu_list(optarg, cpus, MAX_CPUS);
+            long online = sysconf(_SC_NPROCESSORS_CONF);
+            for (int i = 0; i < count; i++)
+                if (cpus[i] >= online) count = -1;
+            if (count < 0) {
+                printf("Invalid CPU list '%s' (expected e.g. 0-3,8 with CPUs below %ld)\n", optarg, online);
+                exit(1);
+            }
+            if (opt == OPT_SUPPLIER_CPUS) supplier_cpu_count = count;
+            else retailer_cpu_count = count;
+            break;
+        }
+        case OPT_MEM_NODE:
+            if (strcmp(optarg, "first-touch") == 0) {
+                mem_node = MEM_NODE_FIRST_TOUCH;
+            } else if (strcmp(optarg, "suppliers") == 0) {
+                mem_node = MEM_NODE_SUPPLIERS;
+            } else if (strcmp(optarg, "retailers") == 0) {
+                mem_node = MEM_NODE_RETAILERS;
+            } else {
+                char* end;
+                long node = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || node < 0 || node >= MAX_NODES) {
+                    printf("Invalid memory node '%s' (expected first-touch, suppliers, retailers or a node number)\n", optarg);
+                    exit(1);
+                }
+                mem_node = (int)node;
+            }
+            break;
+        case OPT_SUPPLIERS:
+            NUM_PRODUCERS = parse_positive(optarg, "number of suppliers");
+            break;
+        case OPT_RETAILERS:
+            NUM_CONSUMERS = parse_positive(optarg, "number of retailers");
+            break;
+        case OPT_COUNT:
+            atomic_store(&warehouse->simulation_count, parse_positive(optarg, "item count"));
+            break;
+        case OPT_LOG:
+            log_path = optarg;
+            break;
+        case OPT_NO_UI:
+            ui_enabled = 0;
+            break;
+        case OPT_CONFIG:
+            break; // already merged in by merge_config_args
+        case OPT_METRICS_PORT:
+            metrics_port = parse_positive(optarg, "metrics port");
+            if (metrics_port > 65535) {
+                printf("Invalid metrics port '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_METRICS_ADDR:
+            metrics_addr = optarg;
+            break;
+        case OPT_SEED: {
+            char* end;
+            workload_seed = strtoull(optarg, &end, 0);
+            if (end == optarg || *end != '\0') {
+                printf("Invalid seed '%s'\n", optarg);
+                exit(1);
+            }
+            seed_given = 1;
+            break;
+        }
+        case OPT_ARRIVAL:
+            if (strcmp(optarg, "fixed") == 0) {
+                arrival_dist = ARRIVAL_FIXED;
+            } else if (strcmp(optarg, "uniform") == 0) {
+                arrival_dist = ARRIVAL_UNIFORM;
+            } else if (strcmp(optarg, "poisson") == 0) {
+                arrival_dist = ARRIVAL_POISSON;
+            } else if (strcmp(optarg, "bursty") == 0) {
+                arrival_dist = ARRIVAL_BURSTY;
+            } else {
+                printf("Unknown arrival distribution '%s' (expected fixed, uniform, poisson or bursty)\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_ARRIVAL_MS:
+            arrival_ms = parse_positive(optarg, "arrival interval");
+            break;
+        case OPT_BURST_MS:
+            burst_ms = parse_positive(optarg, "burst length");
+            break;
+        case OPT_ITEM_DIST:
+        case OPT_PRIORITY_DIST: {
+            int dist;
+            if (strcmp(optarg, "uniform") == 0) {
+                dist = DIST_UNIFORM;
+            } else if (strcmp(optarg, "zipf") == 0) {
+                dist = DIST_ZIPF;
+            } else {
+                printf("Unknown distribution '%s' (expected uniform or zipf)\n", optarg);
+                exit(1);
+            }
+            if (opt == OPT_ITEM_DIST) item_dist = dist;
+            else priority_dist = dist;
+            break;
+        }
+        case OPT_ITEM_RANGE:
+            item_range = parse_positive(optarg, "item range");
+            if (item_range > MAX_ITEM_RANGE) {
+                printf("Item range '%s' is too large (at most %d)\n", optarg, MAX_ITEM_RANGE);
+                exit(1);
+            }
+            break;
+        case OPT_ZIPF_S: {
+            char* end;
+            zipf_s = strtod(optarg, &end);
+            if (end == optarg || *end != '\0' || zipf_s <= 0 || zipf_s > 10) {
+                printf("Invalid Zipf exponent '%s' (expected 0 < s <= 10)\n", optarg);
+                exit(1);
+            }
+            break;
+        }
+        case OPT_ON_SIGNAL:
+            if (strcmp(optarg, "drain") == 0) {
+                on_signal = ON_SIGNAL_DRAIN;
+            } else if (strcmp(optarg, "abort") == 0) {
+                on_signal = ON_SIGNAL_ABORT;
+            } else {
+                printf("Unknown signal policy '%s' (expected drain or abort)\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_DRAIN_TIMEOUT:
+            drain_timeout = parse_positive(optarg, "drain timeout");
+            break;
+        case OPT_SHM:
+            if (optarg[0] != '/' || strchr(optarg + 1, '/') || optarg[1] == '\0') {
+                printf("Invalid shared memory name '%s' (expected /name)\n", optarg);
+                exit(1);
+            }
+            shm_name = optarg;
+            break;
+        case OPT_ROLE:
+            if (strcmp(optarg, "all") == 0) {
+                shm_role = ROLE_ALL;
+            } else if (strcmp(optarg, "suppliers") == 0) {
+                shm_role = ROLE_SUPPLIERS;
+            } else if (strcmp(optarg, "retailers") == 0) {
+                shm_role = ROLE_RETAILERS;
+            } else {
+                printf("Unknown role '%s' (expected all, suppliers or retailers)\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_PAYLOAD: {
+            char* end;
+            long lo = strtol(optarg, &end, 10), hi = lo;
+            if (*end == '-') hi = strtol(end + 1, &end, 10);
+            if (end == optarg || *end != '\0' || lo < 1 || hi < lo || hi > PAYLOAD_MAX_BYTES) {
+                printf("Invalid payload size '%s' (expected MIN-MAX bytes within 1 .. %d)\n", optarg, PAYLOAD_MAX_BYTES);
+                exit(1);
+            }
+            payload_min = (int)lo;
+            payload_max = (int)hi;
+            break;
+        }
+        case OPT_PAYLOAD_ALLOC:
+            if (strcmp(optarg, "arena") == 0) {
+                payload_alloc = PAYLOAD_ARENA;
+            } else if (strcmp(optarg, "malloc") == 0) {
+                payload_alloc = PAYLOAD_MALLOC;
+            } else {
+                printf("Unknown payload allocator '%s' (expected arena or malloc)\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_BENCH_ALLOC: {
+            char copy[64];
+            snprintf(copy, sizeof(copy), "%s", optarg);
+            bench_alloc_points = 0;
+            for (char* save = NULL, *tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+                if (bench_alloc_points == BENCH_MAX_POINTS) break;
+                if (strcmp(tok, "arena") == 0) {
+                    bench_allocs[bench_alloc_points++] = PAYLOAD_ARENA;
+                } else if (strcmp(tok, "malloc") == 0) {
+                    bench_allocs[bench_alloc_points++] = PAYLOAD_MALLOC;
+                } else {
+                    printf("Unknown payload allocator '%s' (expected arena or malloc)\n", tok);
+                    exit(1);
+                }
+            }
+            break;
+        }
+        case OPT_TRACE:
+            trace_path = optarg;
+            break;
+        case OPT_TRACE_SAMPLE:
+            trace_sample = parse_positive(optarg, "trace sampling interval");
+            break;
+        case OPT_TRACE_RESERVOIR:
+            trace_reservoir = parse_positive(optarg, "trace reservoir size");
+            if (trace_reservoir > TRACE_RING_SPANS) {
+                printf("Trace reservoir '%s' is too large (at most %d spans per thread)\n", optarg, TRACE_RING_SPANS);
+                exit(1);
+            }
+            break;
+        case OPT_TASKS:
+            task_workers = parse_positive(optarg, "task worker count");
+            break;
+        case OPT_SHARDS:
+            shard_count = parse_positive(optarg, "shard count");
+            if (shard_count > MAX_SHARDS) {
+                printf("At most %d shards are supported\n", MAX_SHARDS);
+                exit(1);
+            }
+            break;
+        case OPT_AUTOSCALE:
+            autoscale = 1;
+            break;
+        case OPT_AUTOSCALE_MS:
+            autoscale_ms = parse_positive(optarg, "autoscale interval");
+            break;
+        case OPT_AUTOSCALE_HOLD:
+            autoscale_hold = parse_positive(optarg, "autoscale hold");
+            break;
+        case OPT_AUTOSCALE_LATENCY_MS:
+            autoscale_latency_ms = parse_positive(optarg, "autoscale latency target");
+            break;
+        case OPT_OVERFLOW: {
+            int found = 0;
+            for (int p = OVERFLOW_BLOCK; p <= OVERFLOW_SPILL && !found; p++) {
+                if (strcmp(optarg, overflow_name(p)) == 0) {
+                    overflow_policy = p;
+                    found = 1;
+                }
+            }
+            if (!found) {
+                printf("Unknown overflow policy '%s' (expected block, timeout, drop-newest, drop-oldest-normal or spill)\n",
+                       optarg);
+                exit(1);
+            }
+            break;
+        }
+        case OPT_OVERFLOW_TIMEOUT_MS:
+            overflow_timeout_ms = parse_positive(optarg, "overflow timeout");
+            break;
+        case OPT_SPILL_PATH:
+            spill_path = optarg;
+            break;
+        case OPT_SPILL_SEGMENT_SIZE: {
+            unsigned long long value;
+            if (parse_count(optarg, &value) != 0 || value < 4096 || value > (1ULL << 40)) {
+                printf("Invalid spill segment size '%s' (expected at least 4k)\n", optarg);
+                exit(1);
+            }
+            spill_segment_bytes = (size_t)value & ~(size_t)4095;
+            break;
+        }
+        case OPT_SNAPSHOT:
+            snapshot_path = optarg;
+            break;
+        case OPT_SNAPSHOT_MS: {
+            unsigned long long value = 0;
+            if ((strcmp(optarg, "0") != 0 && parse_count(optarg, &value) != 0) || value > 86400000ULL) {
+                printf("Invalid snapshot interval '%s' (0 snapshots only at the end)\n", optarg);
+                exit(1);
+            }
+            snapshot_ms = (long)value;
+            break;
+        }
+        case OPT_RESTORE:
+            restore_path = optarg;
+            break;
+        case OPT_REPLAY:
+            replay_mode = 1;
+            break;
+        case OPT_REPLAY_SPEED: {
+            char* end;
+            replay_speed = strcmp(optarg, "max") == 0 ? 0 : strtod(optarg, &end);
+            if (replay_speed == 0 ? strcmp(optarg, "max") != 0 : end == optarg || *end != '\0' || replay_speed < 0) {
+                printf("Invalid replay speed '%s' (expected a factor such as 1 or 10, or max)\n", optarg);
+                exit(1);
+            }
+            break;
+        }
+        case OPT_REPLAY_BUCKET_MS:
+            replay_bucket_ms = parse_positive(optarg, "replay bucket");
+            break;
+        case OPT_REPLAY_CSV:
+            replay_csv_path = optarg;
+            break;
+        case 'h':
+        default:
+            printf("Usage: %s [--suppliers=N] [--retailers=N] [--count=N] [--no-ui] [--log=PATH] [--config=FILE]\n"
+                   "          [--engine=mutex|lockfree|steal] [--steal-route=rr|least] [--capacity=N[k|m]]\n"
+                   "          [--log-format=classic|precise|binary] [--log-fsync-ms=1000] [--log-fsync-bytes=4m]\n"
+                   "          [--segment-size=64m]\n"
+                   "          [--ui-hz=10] [--supplier-batch=1] [--retailer-batch=1]\n"
+                   "          [--levels=2] [--policy=strict|wrr|deadline] [--wrr-weights=W,...]\n"
+                   "          [--deadline-ms=2000] [--supplier-cpus=LIST] [--retailer-cpus=LIST]\n"
+                   "          [--mem-node=first-touch|suppliers|retailers|N] [--metrics-port=P] [--metrics-addr=127.0.0.1]\n"
+                   "          [--seed=N] [--arrival=fixed|uniform|poisson|bursty] [--arrival-ms=3000] [--burst-ms=MS]\n"
+                   "          [--item-dist=uniform|zipf] [--item-range=100] [--priority-dist=uniform|zipf] [--zipf-s=1.0]\n"
+                   "          [--on-signal=drain|abort] [--drain-timeout=10] [--shm=/NAME [--role=all|suppliers|retailers]]\n"
+                   "          [--payload=MIN-MAX] [--payload-alloc=arena|malloc]\n"
+                   "          [--trace=FILE.json [--trace-sample=N | --trace-reservoir=K]]\n"
+                   "          [--tasks=W] [--shards=N] [--autoscale [--autoscale-ms=1000] [--autoscale-hold=3] [--autoscale-latency-ms=10000]]\n"
+                   "          [--overflow=block|timeout|drop-newest|drop-oldest-normal|spill] [--overflow-timeout-ms=500]\n"
+                   "          [--spill-path=warehouse.spill] [--spill-segment-size=4m]\n"
+                   "          [--snapshot=FILE [--snapshot-ms=5000]] [--restore=FILE]\n"
+                   "       %s --bench [--bench-engines=mutex,lockfree,steal] [--bench-producers=1,2,4]\n"
+                   "          [--bench-consumers=1,2,4] [--bench-capacities=16,1k,64k]\n"
+                   "          [--bench-batch=1,8,64] [--bench-items=1m] [--bench-format=csv|json]\n"
+                   "          [--payload=64-4096 [--bench-alloc=arena,malloc]]\n"
+                   "       %s --stress [--stress-threads=1,16,64] [--stress-seconds=1] [--engine=E] [--capacity=N]\n"
+                   "       %s --read-events [--read-format=classic|precise|csv] FILE...\n"
+                   "       %s --replay [--replay-speed=1|max] [--replay-bucket-ms=100] [--replay-csv=replay.csv]\n"
+                   "          [--engine=E] [--capacity=N] [--levels=N] warehouse.log | SEGMENT...\n",
+                   argv[0], argv[0], argv[0], argv[0], argv[0]);
+            exit(opt == 'h' ? 0 : 1);
+        }
+    }
+}
+
+// Main function
+int main(int argc, char* argv[]) {
+    numa_init();
+#ifdef WAREHOUSE_INSTRUMENT
+    instr_init();
+#endif
+    argv = merge_config_args(&argc, argv);
+    parse_args(argc, argv);
+    if (bench_mode) {
+        trace_init();
+        run_benchmark();
+        trace_write();
+        return 0;
+    }
+    if (stress_mode) {
+        workload_init();
+        return run_stress() == 0 ? 0 : 1;
+    }
+    if (read_events_mode) {
+        if (optind == argc) {
+            printf("--read-events needs at least one segment file\n");
+            return 1;
+        }
+        if (read_format == LOG_FORMAT_CSV)
+            printf("mono_ns,wall_ns,thread,event,item,priority,depth\n");
+        int status = 0;
+        for (int i = optind; i < argc; i++)
+            if (read_event_file(argv[i], read_format) != 0) status = 1;
+        return status;
+    }
+    if (replay_mode) {
+        if (optind == argc) {
+            printf("--replay needs a warehouse.log or at least one event segment\n");
+            return 1;
+        }
+        return run_replay(argc - optind, argv + optind);
+    }
+
+    if (shm_role != ROLE_ALL && !shm_name) {
+        printf("--role needs --shm\n");
+        return 1;
+    }
+    if (shm_name && overflow_policy != OVERFLOW_BLOCK) {
+        printf("--overflow=%s needs a private warehouse and cannot be used with --shm\n", overflow_name(overflow_policy));
+        return 1;
+    }
+    if (task_workers && (shm_name || queue_engine == ENGINE_STEAL || autoscale || overflow_policy == OVERFLOW_TIMEOUT)) {
+        printf("--tasks runs in a private warehouse on the mutex or lockfree engine, without --autoscale "
+               "or --overflow=timeout\n");
+        return 1;
+    }
+    if (shard_count > 1 && (shm_name || queue_engine == ENGINE_STEAL || task_workers || autoscale ||
+                            overflow_policy != OVERFLOW_BLOCK || snapshot_path || restore_path)) {
+        printf("--shards runs in a private warehouse on the mutex or lockfree engine, without --tasks, "
+               "--autoscale, --overflow, --snapshot or --restore\n");
+        return 1;
+    }
+    if (shm_name && (snapshot_path || restore_path)) {
+        printf("--snapshot and --restore need a private warehouse and cannot be used with --shm\n");
+        return 1;
+    }
+    if (shm_name && payload_max) {
+        printf("--payload records live in per-process arenas and cannot be used with --shm\n");
+        return 1;
+    }
+    workload_init();
+    open_log_file();
+    trace_init();
+    spill_open();
+    restore_load();
+
+    // A --role process runs one side only; a process joining a running
+    // shared warehouse takes the count that is already there
+    if (shm_role == ROLE_RETAILERS) NUM_PRODUCERS = 0;
+    if (shm_role == ROLE_SUPPLIERS) NUM_CONSUMERS = 0;
+    int ask_suppliers = NUM_PRODUCERS <= 0 && shm_role != ROLE_RETAILERS;
+    int ask_retailers = NUM_CONSUMERS <= 0 && shm_role != ROLE_SUPPLIERS;
+    int ask_count = atomic_load(&warehouse->simulation_count) <= 0 && !(shm_name && shm_segment_live());
+
+    // Only ask for what was not given as an option; fully configured runs
+    // skip the welcome pauses too, so they start right away
+    int interactive = ask_suppliers || ask_retailers || ask_count;
+    if (interactive) {
+        printf("Welcome to the Warehouse Simulation!\n");
+        sleep(2);
+        printf("This simulation will run until you press Ctrl+C or your simulation counter is ended.\n");
+        sleep(1);
+    }
+
+    if (ask_suppliers) {
+        printf("Enter number of suppliers: ");
+        while (scanf("%d", &NUM_PRODUCERS) != 1 || NUM_PRODUCERS <= 0) {
+            printf("Invalid input. Enter a positive integer for number of suppliers: ");
+            while (getchar() != '\n'); // clear input buffer
+        }
+    }
+
+    if (ask_retailers) {
+        printf("Enter number of retailers: ");
+        while (scanf("%d", &NUM_CONSUMERS) != 1 || NUM_CONSUMERS <= 0) {
+            printf("Invalid input. Enter a positive integer for number of retailers: ");
+            while (getchar() != '\n'); // clear input buffer
+        }
+    }
+
+    if (ask_count) {
+        printf("Enter number of items to be consumed (to bound the simulation): ");
+        int count;
+        while (scanf("%d", &count) != 1 || count <= 0) {
+            printf("Invalid input. Enter a positive integer for number of items: ");
+            while (getchar() != '\n'); // clear input buffer
+        }
+        atomic_store(&warehouse->simulation_count, count);
+    }
+
+    // From here on Ctrl+C shuts down through the coordinator below
+    install_signal_handlers();
+
+    if (ui_enabled) {
+        initscr();      // Start ncurses mode
+        cbreak();       // Disable line buffering
+        noecho();       // Don't echo input
+        curs_set(FALSE);// Hide the cursor
+    }
+
+    init_warehouse();
+    init_statistics();
+    restore_stock();
+    if (ui_enabled) start_ui();
+    start_metrics();
+
+    pthread_t prod_threads[task_workers ? 1 : NUM_PRODUCERS + 1], cons_threads[task_workers ? 1 : NUM_CONSUMERS + 1];
+    atomic_store(&suppliers_left, NUM_PRODUCERS);
+    atomic_store(&retailers_left, NUM_CONSUMERS);
+    start_autoscale();
+    start_snapshots();
+
+    if (task_workers) {
+        start_tasks();
+    } else {
+        for (int i = 0; i < NUM_PRODUCERS; i++)
+            spawn_thread(&prod_threads[i], supplier_cpus, supplier_cpu_count, i, supplier, (void*)(long)(i+1));
+
+        for (int i = 0; i < NUM_CONSUMERS; i++)
+            spawn_thread(&cons_threads[i], retailer_cpus, retailer_cpu_count, i, retailer, (void*)(long)(i+1));
+    }
+
+    coordinate_shutdown(prod_threads, cons_threads);
+    stop_autoscale();
+    stop_snapshots();
 
-    sem_destroy(&empty);
-    sem_destroy(&full);
-    pthread_mutex_destroy(&mutex);
+    if (ui_enabled) stop_ui();
+    stop_metrics();
     close_log_file();
-    endwin(); // End ncurses mode
+    if (ui_enabled) endwin(); // End ncurses mode
     print_final_statistics();
+    trace_write();
+    spill_close();
+    destroy_warehouse();
     return 0;
 }